@@ -1,25 +1,21 @@
 #include "BlobTracker.h"
 #include "point2d.h"
+#include <algorithm>
 #include <list>
 #include <functional>
-#include <set>
 
 using std::vector;
 
-#define OPENCV_VERSION CVAUX_STR(CV_VERSION_MAJOR)""CVAUX_STR(CV_VERSION_MINOR)""CVAUX_STR(CV_VERSION_REVISION)
+#define OPENCV_VERSION CVAUX_STR(CV_VERSION_MAJOR) CVAUX_STR(CV_VERSION_MINOR) CVAUX_STR(CV_VERSION_REVISION)
 
 #if defined _DEBUG
-#pragma comment(lib,"opencv_core"OPENCV_VERSION"d.lib")
-#pragma comment(lib,"opencv_imgproc"OPENCV_VERSION"d.lib")
-#pragma comment(lib,"opencv_features2d"OPENCV_VERSION"d.lib")
-#pragma comment(lib,"opencv_flann"OPENCV_VERSION"d.lib")
-#pragma comment(lib,"opencv_hal"OPENCV_VERSION"d.lib")
+#pragma comment(lib,"opencv_core" OPENCV_VERSION "d.lib")
+#pragma comment(lib,"opencv_imgproc" OPENCV_VERSION "d.lib")
+#pragma comment(lib,"opencv_hal" OPENCV_VERSION "d.lib")
 #else
-#pragma comment(lib,"opencv_core"OPENCV_VERSION".lib")
-#pragma comment(lib,"opencv_imgproc"OPENCV_VERSION".lib")
-#pragma comment(lib,"opencv_features2d"OPENCV_VERSION".lib")
-#pragma comment(lib,"opencv_flann"OPENCV_VERSION".lib")
-#pragma comment(lib,"opencv_hal"OPENCV_VERSION".lib")
+#pragma comment(lib,"opencv_core" OPENCV_VERSION ".lib")
+#pragma comment(lib,"opencv_imgproc" OPENCV_VERSION ".lib")
+#pragma comment(lib,"opencv_hal" OPENCV_VERSION ".lib")
 #endif
 #pragma comment(lib,"ippicvmt.lib")
 
@@ -38,6 +34,7 @@ BlobFinder::Option::Option()
     sort_func = cmp_blob_area;
     handOnlyMode = false;
     handDistance = 0;
+    runLengthMode = false;
 }
 
 #define CVCONTOUR_APPROX_LEVEL  1   // Approx.threshold - the bigger it is, the simpler is the boundary
@@ -66,12 +63,175 @@ static PointState getPointState(const Point& pt, int width, int height)
     return NEAR_NOTHING;
 }
 
-void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option& option)
+static int findRoot(vector<int>& parent, int i)
 {
-    blobs.clear();
-    static vector<Vec4i> hierarchy;
-    static vector<vector<Point>> contours0;
-    static vector<Point> approx;
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Sum of k^2 for k in [0, n].
+static double sumOfSquares(double n)
+{
+    return n * (n + 1) * (2 * n + 1) / 6;
+}
+
+// Single pass 8-connected labelling of foreground runs. Area, bounding box and the first and
+// second order moments are accumulated per run in closed form, so no pixel is visited twice.
+void BlobFinder::labelRuns(const Mat& img, vector<Blob>& blobs, const BlobFinder::Option& option, BlobFinder::Workspace& workspace)
+{
+    typedef Workspace::Run Run;
+    vector<Run>& runs = workspace.runs;
+    vector<int>& rowStart = workspace.rowStart;
+    vector<int>& label = workspace.label;
+
+    runs.clear();
+    label.clear();
+    rowStart.resize(img.rows + 1);
+    for (int y = 0; y < img.rows; y++)
+    {
+        rowStart[y] = runs.size();
+        const uchar* row = img.ptr<uchar>(y);
+        for (int x = 0; x < img.cols; )
+        {
+            while (x < img.cols && !row[x]) x++;
+            if (x == img.cols) break;
+            Run run;
+            run.y = y;
+            run.x1 = x;
+            while (x < img.cols && row[x]) x++;
+            run.x2 = x;
+
+            int self = runs.size();
+            runs.push_back(run);
+            label.push_back(self);
+        }
+
+        if (y == 0) continue;
+        // Merge with the runs above that touch, diagonals included.
+        int a = rowStart[y - 1], aEnd = rowStart[y];
+        for (int b = rowStart[y]; b < (int)runs.size(); b++)
+        {
+            while (a < aEnd && runs[a].x2 < runs[b].x1) a++;
+            for (int k = a; k < aEnd && runs[k].x1 <= runs[b].x2; k++)
+            {
+                int ra = findRoot(label, k), rb = findRoot(label, b);
+                if (ra < rb) label[rb] = ra;
+                else if (rb < ra) label[ra] = rb;
+            }
+        }
+    }
+    rowStart[img.rows] = runs.size();
+
+    // Roots are the first run of their component, so components come out in scan order.
+    const int n_runs = runs.size();
+    vector<int>& component = workspace.component;
+    vector<Workspace::Moments>& moments = workspace.moments;
+    component.resize(n_runs);
+    moments.clear();
+    for (int i = 0; i < n_runs; i++)
+    {
+        const Run& run = runs[i];
+        int root = findRoot(label, i);
+        if (root == i)
+        {
+            component[i] = moments.size();
+            Workspace::Moments m = { 0, 0, 0, 0, 0, 0, run.x1, run.y, run.x2, run.y + 1 };
+            moments.push_back(m);
+        }
+        else
+        {
+            component[i] = component[root];
+        }
+        Workspace::Moments& m = moments[component[i]];
+
+        double n = run.x2 - run.x1;
+        double sx = n * (run.x1 + run.x2 - 1) * 0.5;
+        m.n += n;
+        m.sx += sx;
+        m.sy += n * run.y;
+        m.sxx += sumOfSquares(run.x2 - 1) - sumOfSquares(run.x1 - 1);
+        m.syy += n * run.y * run.y;
+        m.sxy += sx * run.y;
+        m.x1 = std::min(m.x1, run.x1);
+        m.x2 = std::max(m.x2, run.x2);
+        m.y2 = run.y + 1;
+    }
+
+    // Group runs per component for findContour().
+    const int n_components = moments.size();
+    vector<int>& start = workspace.componentStart;
+    vector<int>& grouped = workspace.componentRuns;
+    start.assign(n_components + 1, 0);
+    for (int i = 0; i < n_runs; i++) start[component[i] + 1]++;
+    for (int c = 0; c < n_components; c++) start[c + 1] += start[c];
+    grouped.resize(n_runs);
+    for (int i = 0; i < n_runs; i++) grouped[start[component[i]]++] = i;
+    for (int c = n_components; c > 0; c--) start[c] = start[c - 1];
+    start[0] = 0;
+
+    for (int c = 0; c < n_components; c++)
+    {
+        const Workspace::Moments& m = moments[c];
+        if (m.n < option.minArea || m.n > option.maxArea) continue;
+
+        blobs.push_back(Blob());
+        Blob& obj = blobs.back();
+        obj.area = m.n;
+        obj.component = c;
+        obj.box = Rect(m.x1, m.y1, m.x2 - m.x1, m.y2 - m.y1);
+        obj.center.x = m.sx / m.n;
+        obj.center.y = m.sy / m.n;
+
+        // Orientation and extent of the rectangle with the same second moments.
+        double mu20 = m.sxx / m.n - obj.center.x * obj.center.x;
+        double mu02 = m.syy / m.n - obj.center.y * obj.center.y;
+        double mu11 = m.sxy / m.n - obj.center.x * obj.center.y;
+        double common = sqrt(4 * mu11 * mu11 + (mu20 - mu02) * (mu20 - mu02));
+        double major = std::max(0.0, (mu20 + mu02 + common) * 0.5);
+        double minor = std::max(0.0, (mu20 + mu02 - common) * 0.5);
+        obj.rotBox.center = obj.center;
+        obj.rotBox.size = cv::Size2f(sqrt(12 * major), sqrt(12 * minor));
+        obj.rotBox.angle = 0.5 * atan2(2 * mu11, mu20 - mu02) * GRAD_PI;   // of the major axis, not minAreaRect's convention
+        obj.angle = (90 - obj.rotBox.angle)*GRAD_PI2;//in radians
+    }
+}
+
+void BlobFinder::findContour(Blob& blob, const BlobFinder::Option& option, BlobFinder::Workspace& workspace)
+{
+    if (!blob.pts.empty() || blob.component < 0) return;
+
+    // Repaint only this component, neighbours inside the bounding box must not leak in.
+    Mat& mask = workspace.contourMask;
+    mask.create(blob.box.height + 2, blob.box.width + 2, CV_8UC1);
+    mask.setTo(0);
+    for (int k = workspace.componentStart[blob.component]; k < workspace.componentStart[blob.component + 1]; k++)
+    {
+        const Workspace::Run& run = workspace.runs[workspace.componentRuns[k]];
+        uchar* row = mask.ptr<uchar>(run.y - blob.box.y + 1);
+        std::fill(row + run.x1 - blob.box.x + 1, row + run.x2 - blob.box.x + 1, 255);
+    }
+
+    findContours(mask, workspace.contours, workspace.hierarchy, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE,
+        blob.box.tl() - Point(1, 1));
+    if (workspace.contours.empty()) return;
+
+    const vector<Point>& contour = workspace.contours[0];
+    blob.length = arcLength(contour, true);
+    if (option.convexHull)
+        convexHull(contour, blob.pts);
+    else
+        approxPolyDP(contour, blob.pts, std::min<double>(blob.length*0.003, 2.0), true);
+}
+
+void BlobFinder::traceContours(Mat& img, vector<Blob>& blobs, const BlobFinder::Option& option, BlobFinder::Workspace& workspace)
+{
+    vector<Vec4i>& hierarchy = workspace.hierarchy;
+    vector<vector<Point>>& contours0 = workspace.contours;
+    vector<Point>& approx = workspace.approx;
 
     findContours(img, contours0, hierarchy, RETR_EXTERNAL/*RETR_TREE*/, CHAIN_APPROX_SIMPLE);
 
@@ -117,6 +277,24 @@ void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option
         }
         isHole = true;
     }
+}
+
+void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option& option, BlobFinder::Workspace& workspace)
+{
+    blobs.clear();
+    if (option.runLengthMode)
+    {
+        labelRuns(img, blobs, option, workspace);
+        // The hand heuristics below work on the outline.
+        if (option.handOnlyMode)
+        {
+            for (auto& b : blobs) findContour(b, option, workspace);
+        }
+    }
+    else
+    {
+        traceContours(img, blobs, option, workspace);
+    }
 
     const int handRegionDistance = 30;
     if (option.handOnlyMode)
@@ -127,9 +305,11 @@ void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option
         // post-processing for fake hand tracking
         for (auto& b : blobs)
         {
-            std::set<PointState> NearPointSet;
+            // One bit per PointState, only whether one or several sides are touched matters.
+            unsigned int nearSides = 0;
 
-            vector<Point> new_pts;
+            vector<Point>& new_pts = workspace.handPts;
+            new_pts.clear();
             Point pt_ref(img.cols / 2, img.rows / 2);
 
             for (int j = 0; j < b.pts.size(); j++)
@@ -137,19 +317,19 @@ void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option
                 PointState st = getPointState(b.pts[j], img.cols, img.rows);
                 if (st != NEAR_NOTHING)
                 {
-                    NearPointSet.insert(st);
+                    nearSides |= 1u << st;
                     pt_ref = b.pts[j];
                     //break;
                 }
             }
 
-            if (NearPointSet.size() > 1)
+            if (nearSides & (nearSides - 1))
             {
                 // skip blobs that touchs multiple sides
                 continue;
             }
             int min_idx = -1;
-            bool only_one_near = NearPointSet.size() == 1;
+            bool only_one_near = nearSides != 0;
             int min_value = only_one_near ? 0 : INT_MAX;
 
             for (int j = 0; j<b.pts.size(); j++)
@@ -184,7 +364,7 @@ void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option
             }
             b.center.x = sum_x / n_neighbors;
             b.center.y = sum_y / n_neighbors;
-            b.pts = new_pts;
+            b.pts.swap(new_pts);
         }
     }
 
@@ -194,6 +374,282 @@ void BlobFinder::execute(Mat& img, vector<Blob>& blobs, const BlobFinder::Option
 BlobTracker::BlobTracker()
 {
     IDCounter = 0;
+    maxMatchDistance = 200;
+    kalmanGate = 9.21f;
+    globalAssignment = false;
+    kalmanFiltering = false;
+    processNoise = 16;
+    measurementNoise = 16;
+    movementFiltering = 2;
+    ghostFrames = 0;
+    filtersKalman = false;
+}
+
+void BlobTracker::MotionFilters::resize(size_t n)
+{
+    x.resize(n);
+    y.resize(n);
+    vx.resize(n);
+    vy.resize(n);
+    p00.resize(n);
+    p01.resize(n);
+    p11.resize(n);
+}
+
+void BlobTracker::MotionFilters::reset(int i, const Point2f& center, float positionVariance, float velocityVariance)
+{
+    x[i] = center.x;
+    y[i] = center.y;
+    vx[i] = vy[i] = 0;
+    p00[i] = positionVariance;
+    p01[i] = 0;
+    p11[i] = velocityVariance;
+}
+
+// x += v, P = F P F' + Q with Q the white acceleration noise of a one frame step.
+void BlobTracker::MotionFilters::predict(float processNoise)
+{
+    const int n = x.size();
+    for (int i = 0; i < n; i++)
+    {
+        x[i] += vx[i];
+        y[i] += vy[i];
+        float a = p00[i], b = p01[i], c = p11[i];
+        p00[i] = a + 2 * b + c + processNoise * 0.25f;
+        p01[i] = b + c + processNoise * 0.5f;
+        p11[i] = c + processNoise;
+    }
+}
+
+void BlobTracker::MotionFilters::correct(int i, const Point2f& measured, float measurementNoise)
+{
+    float s = p00[i] + measurementNoise;
+    float k0 = p00[i] / s, k1 = p01[i] / s;
+    float ex = measured.x - x[i], ey = measured.y - y[i];
+    x[i] += k0 * ex;
+    y[i] += k0 * ey;
+    vx[i] += k1 * ex;
+    vy[i] += k1 * ey;
+
+    float a = p00[i], b = p01[i];
+    p00[i] = (1 - k0) * a;
+    p01[i] = (1 - k0) * b;
+    p11[i] -= k1 * b;
+}
+
+void BlobTracker::MotionFilters::move(int dst, int src)
+{
+    x[dst] = x[src];
+    y[dst] = y[src];
+    vx[dst] = vx[src];
+    vy[dst] = vy[src];
+    p00[dst] = p00[src];
+    p01[dst] = p01[src];
+    p11[dst] = p11[src];
+}
+
+// How well a blob at center matches track i, FLT_MAX outside the gate. Without Kalman filtering this is
+// the squared distance to the last center. With it, it is the squared Mahalanobis distance to the predicted
+// center under the innovation covariance S = P + R, so the gate follows the uncertainty of each track:
+// tight for a steady track, wide for a new or coasting one.
+float BlobTracker::matchScore2(int i, const Point2f& center) const
+{
+    float ex = filters.x[i] - center.x;
+    float ey = filters.y[i] - center.y;
+    float dist2 = ex * ex + ey * ey;
+    if (dist2 >= maxMatchDistance * maxMatchDistance) return FLT_MAX;
+    if (!kalmanFiltering) return dist2;
+
+    float mahalanobis2 = dist2 / (filters.p00[i] + measurementNoise);
+    return mahalanobis2 < kalmanGate ? mahalanobis2 : FLT_MAX;
+}
+
+// Track i was matched with a new blob, take over its shape and filter its center.
+void BlobTracker::updateTrack(int i, TrackedBlob& measured)
+{
+    TrackedBlob& blob = trackedBlobs[i];
+    Point2f lastCenter = blob.center;
+    measured.id = blob.id;//save id, cause we will overwrite the data
+    blob = measured;//update with new data
+    blob.framesLeft = ghostFrames;
+
+    if (kalmanFiltering)
+    {
+        filters.correct(i, blob.center, measurementNoise);
+        blob.center = Point2f(filters.x[i], filters.y[i]);
+        blob.velocity = Point2f(filters.vx[i], filters.vy[i]);
+        return;
+    }
+
+    blob.velocity.x = blob.center.x - lastCenter.x;
+    blob.velocity.y = blob.center.y - lastCenter.y;
+    float posDelta = sqrtf((blob.velocity.x*blob.velocity.x) + (blob.velocity.y*blob.velocity.y));
+
+    // AlexP
+    // now, filter the blob position based on movementFiltering value
+    // the movementFiltering ranges [0,15] so we will have that many filtering steps
+    // Here we have a weighted low-pass filter
+    // adaptively adjust the blob position filtering strength based on blob movement
+    // http://www.wolframalpha.com/input/?i=plot+1/exp(x/15)+and+1/exp(x/10)+and+1/exp(x/5)+from+0+to+100
+    float a = 1.0f - 1.0f / expf(posDelta / (1.0f + (float)movementFiltering * 10));
+    blob.center.x = a * blob.center.x + (1 - a) * lastCenter.x;
+    blob.center.y = a * blob.center.y + (1 - a) * lastCenter.y;
+}
+
+// Track i has no blob this frame (ghost frame), keep it at its predicted position for now.
+void BlobTracker::coastTrack(int i)
+{
+    TrackedBlob& blob = trackedBlobs[i];
+    blob.framesLeft--;
+    blob.markedForDeletion = true;
+
+    Point2f predicted(filters.x[i], filters.y[i]);
+    Point offset(cvRound(predicted.x - blob.center.x), cvRound(predicted.y - blob.center.y));
+    blob.box.x += offset.x;
+    blob.box.y += offset.y;
+    blob.center = predicted;
+}
+
+int BlobTracker::cellBucket(int cx, int cy) const
+{
+    unsigned int h = (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u;
+    return h & (gridHead.size() - 1);
+}
+
+void BlobTracker::buildGrid()
+{
+    const int n_old = trackedBlobs.size();
+    size_t buckets = 16;
+    while (buckets < size_t(n_old) * 2) buckets *= 2;
+
+    gridHead.assign(buckets, -1);
+    gridNext.resize(n_old);
+    const float cellScale = 1.0f / maxMatchDistance;
+    for (int i = 0; i < n_old; i++)
+    {
+        Point2f c(filters.x[i], filters.y[i]);
+        int bucket = cellBucket((int)floorf(c.x * cellScale), (int)floorf(c.y * cellScale));
+        gridNext[i] = gridHead[bucket];
+        gridHead[bucket] = i;
+    }
+}
+
+// Calls visit(track, score2) for every track whose gate contains center, see matchScore2().
+// maxMatchDistance bounds every gate, so the 3x3 cells around center hold all candidates.
+template <typename Visitor>
+void BlobTracker::forEachCandidate(const Point2f& center, Visitor visit) const
+{
+    const float cellScale = 1.0f / maxMatchDistance;
+    const int cx = (int)floorf(center.x * cellScale);
+    const int cy = (int)floorf(center.y * cellScale);
+
+    // Colliding cells share a bucket, the distance test sorts out their tracks but each
+    // bucket must only be walked once or its tracks would be visited twice.
+    int visited[9];
+    int n_visited = 0;
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            int bucket = cellBucket(cx + dx, cy + dy);
+            if (std::find(visited, visited + n_visited, bucket) != visited + n_visited) continue;
+            visited[n_visited++] = bucket;
+
+            for (int i = gridHead[bucket]; i != -1; i = gridNext[i])
+            {
+                float score2 = matchScore2(i, center);
+                if (score2 != FLT_MAX) visit(i, score2);
+            }
+        }
+    }
+}
+
+// Best matching tracked blob inside its gate, or -1.
+int BlobTracker::findNearest(const Point2f& center, float* score2) const
+{
+    int best = -1;
+    float bestScore2 = FLT_MAX;
+    forEachCandidate(center, [&](int i, float s2)
+    {
+        if (s2 < bestScore2 || (s2 == bestScore2 && i < best))
+        {
+            bestScore2 = s2;
+            best = i;
+        }
+    });
+    *score2 = bestScore2;
+    return best;
+}
+
+// Maximizes the summed (gate - distance) over all matches with a Gauss-Seidel auction, where
+// every new blob can also stay unmatched at no benefit. Distances are in the metric of
+// matchScore2(), pixels or standard deviations. Only pairs inside the gate are bid on, so a
+// frame costs about the number of candidate pairs. Fills nn_of_a/score_of_a like the greedy path.
+void BlobTracker::assignGlobally(int n_new)
+{
+    const float gate = kalmanFiltering ? sqrtf(kalmanGate) : maxMatchDistance;
+    candStart.resize(n_new + 1);
+    candTrack.clear();
+    candBenefit.clear();
+    for (int q_id = 0; q_id < n_new; q_id++)
+    {
+        candStart[q_id] = candTrack.size();
+        forEachCandidate(newTrackedBlobs[q_id].center, [&](int i, float score2)
+        {
+            candTrack.push_back(i);
+            candBenefit.push_back(gate - sqrtf(score2));
+        });
+    }
+    candStart[n_new] = candTrack.size();
+
+    const int n_old = trackedBlobs.size();
+    prices.assign(n_old, 0);
+
+    // A single forward phase from zero prices: a track that was never bid on keeps price 0,
+    // which is what makes the result optimal within n_new * eps with unmatched blobs allowed.
+    const float eps = gate * 0.001f;
+    bidders.clear();
+    for (int q_id = n_new - 1; q_id >= 0; q_id--)
+    {
+        if (candStart[q_id] != candStart[q_id + 1]) bidders.push_back(q_id);
+    }
+
+    while (!bidders.empty())
+    {
+        int q_id = bidders.back();
+        bidders.pop_back();
+
+        // Staying unmatched is worth 0 and never gets more expensive.
+        int best = -1;
+        float bestValue = 0;
+        float secondValue = 0;
+        for (int c = candStart[q_id]; c < candStart[q_id + 1]; c++)
+        {
+            float value = candBenefit[c] - prices[candTrack[c]];
+            if (value > bestValue)
+            {
+                secondValue = bestValue;
+                bestValue = value;
+                best = candTrack[c];
+            }
+            else if (value > secondValue)
+            {
+                secondValue = value;
+            }
+        }
+        if (best == -1) continue;
+
+        prices[best] += bestValue - secondValue + eps;
+        if (nn_of_a[best] != -1) bidders.push_back(nn_of_a[best]);
+        nn_of_a[best] = q_id;
+    }
+
+    for (int t_id = 0; t_id < n_old; t_id++)
+    {
+        int q_id = nn_of_a[t_id];
+        if (q_id == -1) continue;
+        score_of_a[t_id] = matchScore2(t_id, newTrackedBlobs[q_id].center);
+    }
 }
 
 void BlobTracker::trackBlobs(const vector<Blob>& newBlobs)
@@ -201,44 +657,62 @@ void BlobTracker::trackBlobs(const vector<Blob>& newBlobs)
     deadBlobs.clear();
     const int n_old = trackedBlobs.size();
     const int n_new = newBlobs.size();
-    vector<TrackedBlob> newTrackedBlobs(n_new);
-    std::copy(newBlobs.begin(), newBlobs.end(), newTrackedBlobs.begin());
 
-    vector<int> nn_of_a(n_old);//nearest neighbor of pta in ptb
-    vector<int> dist_of_a(n_old);//nearest neighbor of pta in ptb
-    fill(nn_of_a.begin(), nn_of_a.end(), -1);
-    fill(dist_of_a.begin(), dist_of_a.end(), INT_MAX);
+    // Assigning through Blob keeps the capacity of pts from previous frames.
+    newTrackedBlobs.resize(n_new);
+    for (int i = 0; i < n_new; i++)
+    {
+        static_cast<Blob&>(newTrackedBlobs[i]) = newBlobs[i];
+        newTrackedBlobs[i].id = TrackedBlob::BLOB_NEW_ID;
+        newTrackedBlobs[i].velocity = Point2f();
+        newTrackedBlobs[i].markedForDeletion = false;
+        newTrackedBlobs[i].framesLeft = 0;
+    }
+
+    nn_of_a.assign(n_old, -1);
+    score_of_a.assign(n_old, FLT_MAX);
 
-    if (n_old != 0 && n_new != 0)
+    // Whatever the filters hold from before the switch is stale, restart them from the current centers.
+    if (kalmanFiltering != filtersKalman)
     {
-        Mat1f ma(trackedBlobs.size(), 2);
-        Mat1f mb(newBlobs.size(), 2);
         for (int i = 0; i < n_old; i++)
         {
-            ma(i, 0) = trackedBlobs[i].center.x;
-            ma(i, 1) = trackedBlobs[i].center.y;
+            filters.reset(i, trackedBlobs[i].center, measurementNoise, maxMatchDistance * maxMatchDistance * 0.25f);
+            trackedBlobs[i].velocity = Point2f();
         }
-        for (int i = 0; i < n_new; i++)
+        filtersKalman = kalmanFiltering;
+    }
+
+    // Matching is done against where the tracks are expected to be now.
+    if (kalmanFiltering)
+    {
+        filters.predict(processNoise);
+    }
+    else
+    {
+        for (int i = 0; i < n_old; i++)
         {
-            mb(i, 0) = newTrackedBlobs[i].center.x;
-            mb(i, 1) = newTrackedBlobs[i].center.y;
+            filters.x[i] = trackedBlobs[i].center.x;
+            filters.y[i] = trackedBlobs[i].center.y;
         }
+    }
 
-        BFMatcher matcher(NORM_L2);
-        static vector<DMatch> matches;
-        matcher.match(mb, ma, matches);
-        const int n_matches = matches.size();
-        for (int i = 0; i < n_matches; i++)
+    if (n_old != 0 && n_new != 0 && globalAssignment)
+    {
+        buildGrid();
+        assignGlobally(n_new);
+    }
+    else if (n_old != 0 && n_new != 0)
+    {
+        buildGrid();
+        // Every new blob picks its nearest tracked blob, every tracked blob keeps the closest taker.
+        for (int q_id = 0; q_id < n_new; q_id++)
         {
-            const DMatch& match = matches[i];
-            int t_id = match.trainIdx;
-            int q_id = match.queryIdx;
-            float dist = match.distance;
-
-            //TODO: 200 -> param
-            if (dist < 200 && dist < dist_of_a[t_id])
+            float score2;
+            int t_id = findNearest(newTrackedBlobs[q_id].center, &score2);
+            if (t_id != -1 && score2 < score_of_a[t_id])
             {
-                dist_of_a[t_id] = dist;
+                score_of_a[t_id] = score2;
                 nn_of_a[t_id] = q_id;
             }
         }
@@ -250,26 +724,11 @@ void BlobTracker::trackBlobs(const vector<Blob>& newBlobs)
         if (nn != -1)
         {
             //moving blobs
-            Point2f lastCenter = trackedBlobs[i].center;
-            newTrackedBlobs[nn].id = trackedBlobs[i].id;//save id, cause we will overwrite the data
-            trackedBlobs[i] = newTrackedBlobs[nn];//update with new data
-
-            // TODO: ....
-            trackedBlobs[i].velocity.x = trackedBlobs[i].center.x - lastCenter.x;
-            trackedBlobs[i].velocity.y = trackedBlobs[i].center.y - lastCenter.y;
-            float posDelta = sqrtf((trackedBlobs[i].velocity.x*trackedBlobs[i].velocity.x) +
-                (trackedBlobs[i].velocity.y*trackedBlobs[i].velocity.y));
-
-            // AlexP
-            // now, filter the blob position based on MOVEMENT_FILTERING value
-            // the MOVEMENT_FILTERING ranges [0,15] so we will have that many filtering steps
-            // Here we have a weighted low-pass filter
-            // adaptively adjust the blob position filtering strength based on blob movement
-            // http://www.wolframalpha.com/input/?i=plot+1/exp(x/15)+and+1/exp(x/10)+and+1/exp(x/5)+from+0+to+100
-#define MOVEMENT_FILTERING 2
-            float a = 1.0f - 1.0f / expf(posDelta / (1.0f + (float)MOVEMENT_FILTERING * 10));
-            trackedBlobs[i].center.x = a * trackedBlobs[i].center.x + (1 - a) * lastCenter.x;
-            trackedBlobs[i].center.y = a * trackedBlobs[i].center.y + (1 - a) * lastCenter.y;
+            updateTrack(i, newTrackedBlobs[nn]);
+        }
+        else if (trackedBlobs[i].framesLeft > 0)
+        {
+            coastTrack(i);
         }
         else
         {
@@ -277,8 +736,21 @@ void BlobTracker::trackBlobs(const vector<Blob>& newBlobs)
             trackedBlobs[i].id = TrackedBlob::BLOB_TO_DELETE;
         }
     }
-    trackedBlobs.erase(remove_if(trackedBlobs.begin(), trackedBlobs.end(), std::mem_fun_ref(&TrackedBlob::isDead)),
-        trackedBlobs.end());
+
+    // Drop dead tracks, keeping the filters parallel.
+    int n_alive = 0;
+    for (int i = 0; i < n_old; i++)
+    {
+        if (trackedBlobs[i].isDead()) continue;
+        if (n_alive != i)
+        {
+            trackedBlobs[n_alive] = trackedBlobs[i];
+            filters.move(n_alive, i);
+        }
+        n_alive++;
+    }
+    trackedBlobs.resize(n_alive);
+
     //entering blobs
     for (int i = 0; i<n_new; i++)
     {
@@ -289,7 +761,15 @@ void BlobTracker::trackBlobs(const vector<Blob>& newBlobs)
             if (IDCounter > MAX_BLOB_ID)
                 IDCounter = 0;
             newTrackedBlobs[i].id = IDCounter++;
+            newTrackedBlobs[i].framesLeft = ghostFrames;
             trackedBlobs.push_back(newTrackedBlobs[i]);
         }
     }
+
+    const int n_tracks = trackedBlobs.size();
+    filters.resize(n_tracks);
+    for (int i = n_alive; i < n_tracks; i++)
+    {
+        filters.reset(i, trackedBlobs[i].center, measurementNoise, maxMatchDistance * maxMatchDistance * 0.25f);
+    }
 }
@@ -20,7 +20,6 @@
 
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/features2d/features2d.hpp"
 
 #include "point2d.h"
 
@@ -37,6 +36,7 @@ struct Blob
         angle = 0;
         length = 0;
         isHole = false;
+        component = -1;
     }
 
     Blob(const Blob &b) : box(b.box), center(b.center), pts(b.pts), rotBox(b.rotBox)
@@ -45,6 +45,7 @@ struct Blob
         angle = b.angle;
         isHole = b.isHole;
         length = b.length;
+        component = b.component;
     }
 
     Blob(Rect rc, Point ct, float _area = 0, float _angle = 0, bool hole = false)
@@ -55,6 +56,7 @@ struct Blob
         angle = _angle;
         isHole = hole;
         length = 0;
+        component = -1;
     }
 
     Blob &operator = (const Blob &b)
@@ -67,6 +69,7 @@ struct Blob
         angle = b.angle;
         isHole = b.isHole;
         length = b.length;
+        component = b.component;
         return *this;
     }
 
@@ -79,6 +82,7 @@ struct Blob
     float area;
     float length;
     bool isHole;
+    int component;  // run length mode: source of BlobFinder::findContour(), valid until the next execute()
 
     bool operator<(const Blob &other) const
     {
@@ -135,8 +139,45 @@ struct BlobFinder
         bool(*sort_func)(const Blob &a, const Blob &b);
         bool handOnlyMode;
         int handDistance;
+        bool runLengthMode;     // label runs instead of tracing contours, pts/length are left empty
     };
-    static void execute(cv::Mat &src, std::vector<Blob> &blobs, const Option& option);
+
+    // Scratch buffers of execute(), reused across calls. Use one per thread, e.g. per camera.
+    struct Workspace
+    {
+        std::vector<cv::Vec4i> hierarchy;
+        std::vector<std::vector<Point> > contours;
+        std::vector<Point> approx;
+        std::vector<Point> handPts;
+
+        // run length mode
+        struct Run
+        {
+            int y, x1, x2;  // x2 exclusive
+        };
+        struct Moments
+        {
+            double n, sx, sy, sxx, syy, sxy;
+            int x1, y1, x2, y2;
+        };
+        std::vector<Run> runs;
+        std::vector<int> rowStart;          // first run of every row, rows + 1 entries
+        std::vector<int> label;             // union-find parent of every run
+        std::vector<int> component;         // of every run
+        std::vector<Moments> moments;       // per component
+        std::vector<int> componentStart;    // runs of every component, grouped
+        std::vector<int> componentRuns;
+        cv::Mat contourMask;
+    };
+
+    static void execute(cv::Mat &src, std::vector<Blob> &blobs, const Option& option, Workspace& workspace);
+
+    // Traces pts and length of a blob found in run length mode, no-op if it already has them.
+    static void findContour(Blob& blob, const Option& option, Workspace& workspace);
+
+private:
+    static void traceContours(cv::Mat& src, std::vector<Blob>& blobs, const Option& option, Workspace& workspace);
+    static void labelRuns(const cv::Mat& src, std::vector<Blob>& blobs, const Option& option, Workspace& workspace);
 };
 
 class BlobTracker
@@ -148,6 +189,56 @@ public:
     std::vector<TrackedBlob>   trackedBlobs; //tracked blobs
     std::vector<TrackedBlob>  deadBlobs;
 
+    float maxMatchDistance;     // blobs moving further than this between frames become new tracks
+    float kalmanGate;           // Kalman: largest squared Mahalanobis distance of a match, 9.21 keeps 99%
+    bool globalAssignment;      // match all blobs jointly instead of each to its nearest track
+    bool kalmanFiltering;       // predict and smooth centers with a constant velocity Kalman filter
+    float processNoise;         // Kalman acceleration variance, pixels^2 / frame^4
+    float measurementNoise;     // Kalman variance of measured centers, pixels^2
+    int movementFiltering;      // [0,15] strength of the adaptive low pass used without Kalman filtering
+    int ghostFrames;            // frames a track survives without a matching blob
+
 private:
+    // Per track constant velocity Kalman filter, arrays parallel to trackedBlobs.
+    // x and y share the motion model and noise, so they also share one covariance.
+    struct MotionFilters
+    {
+        std::vector<float> x, y, vx, vy;    // predicted before matching, corrected after
+        std::vector<float> p00, p01, p11;   // position/velocity covariance
+
+        void resize(size_t n);
+        void reset(int i, const Point2f& center, float positionVariance, float velocityVariance);
+        void predict(float processNoise);
+        void correct(int i, const Point2f& measured, float measurementNoise);
+        void move(int dst, int src);
+    };
+
+    float matchScore2(int i, const Point2f& center) const;
+    void updateTrack(int i, TrackedBlob& measured);
+    void coastTrack(int i);
+
+    // Spatial hash of the tracked blob centers with cells of maxMatchDistance, so a new blob
+    // only has to look at its own and the 8 neighbouring cells. Buffers are reused across frames.
+    int cellBucket(int cx, int cy) const;
+    void buildGrid();
+    template <typename Visitor>
+    void forEachCandidate(const Point2f& center, Visitor visit) const;
+    int findNearest(const Point2f& center, float* score2) const;
+    void assignGlobally(int n_new);
+
     unsigned int                        IDCounter;    //counter of last blob
+    std::vector<TrackedBlob>            newTrackedBlobs;
+    std::vector<int>                    gridHead;     //first tracked blob of each bucket, -1 if empty
+    std::vector<int>                    gridNext;     //next tracked blob in the same bucket
+    std::vector<int>                    nn_of_a;      //nearest new blob of each tracked blob
+    std::vector<float>                  score_of_a;   //matchScore2() of that blob
+    MotionFilters                       filters;
+    bool                                filtersKalman; //kalmanFiltering the filters were last run with
+
+    // assignGlobally() workspace, candidate tracks of every new blob in CSR layout.
+    std::vector<int>                    candStart;
+    std::vector<int>                    candTrack;
+    std::vector<float>                  candBenefit;
+    std::vector<float>                  prices;
+    std::vector<int>                    bidders;
 };
@@ -0,0 +1,220 @@
+/*
+* ColorHistogram.h
+*
+* Compact 64 bin RGB histogram (4 levels per channel) used to double check
+* depth based pickup/return decisions against the item's color snapshot.
+*
+* compute() derives the bin index of 4 pixels at a time with SSE2 when the
+* surface has 4 bytes per pixel and counts into 4 interleaved sub-histograms
+* so consecutive increments don't depend on each other. Other layouts take
+* the scalar path, which produces identical results.
+*
+* The offsets overload only counts the listed pixels of the area, e.g. the
+* color pixels an item's depth ROI maps to. With SSE2 and 4 bytes per pixel
+* it turns 4 offsets at a time into addresses in float arithmetic, loads the
+* 4 pixels and bins them like compute().
+*
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "cinder/Area.h"
+#include "cinder/Surface.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COLOR_HISTOGRAM_SSE2 1
+#endif
+
+struct ColorHistogram
+{
+    static const int kBins = 64;
+
+    uint32_t bins[kBins];
+    uint32_t total = 0;
+
+    ColorHistogram()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(bins, 0, sizeof(bins));
+        total = 0;
+    }
+
+    void compute(const ci::Surface8u& surface, ci::Area area)
+    {
+        clear();
+        area.clipBy(surface.getBounds());
+        if (area.calcArea() == 0) return;
+
+        const int pixelInc = surface.getPixelInc();
+        const int rOff = surface.getRedOffset(), gOff = surface.getGreenOffset(), bOff = surface.getBlueOffset();
+        const int w = area.getWidth();
+
+        uint32_t sub[4][kBins];
+        memset(sub, 0, sizeof(sub));
+
+        for (int y = area.y1; y < area.y2; y++)
+        {
+            const uint8_t* row = surface.getData(ci::ivec2(area.x1, y));
+            int x = 0;
+#if COLOR_HISTOGRAM_SSE2
+            if (pixelInc == 4)
+            {
+                const __m128i rShift = _mm_cvtsi32_si128(rOff * 8);
+                const __m128i gShift = _mm_cvtsi32_si128(gOff * 8);
+                const __m128i bShift = _mm_cvtsi32_si128(bOff * 8);
+                alignas(16) uint32_t idx[4];
+                for (; x + 4 <= w; x += 4)
+                {
+                    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x * 4));
+                    _mm_store_si128(reinterpret_cast<__m128i*>(idx), binsOf4(px, rShift, gShift, bShift));
+                    sub[0][idx[0]]++;
+                    sub[1][idx[1]]++;
+                    sub[2][idx[2]]++;
+                    sub[3][idx[3]]++;
+                }
+            }
+#endif
+            for (; x < w; x++)
+            {
+                const uint8_t* p = row + x * pixelInc;
+                int bin = ((p[rOff] >> 6) << 4) | ((p[gOff] >> 6) << 2) | (p[bOff] >> 6);
+                sub[x & 3][bin]++;
+            }
+        }
+
+        for (int i = 0; i < kBins; i++)
+        {
+            bins[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+        }
+        total = area.calcArea();
+    }
+
+    // Counts the pixels of area at offsets (y * area width + x), negative offsets are skipped.
+    // Pixels listed more than once are counted more than once.
+    void compute(const ci::Surface8u& surface, ci::Area area, const int32_t* offsets, int count)
+    {
+        clear();
+        // Offsets are relative to the unclipped area, so it has to fit as is.
+        ci::Area clipped = area;
+        clipped.clipBy(surface.getBounds());
+        if (area.calcArea() == 0 || clipped != area) return;
+
+        const int pixelInc = surface.getPixelInc();
+        const int rOff = surface.getRedOffset(), gOff = surface.getGreenOffset(), bOff = surface.getBlueOffset();
+        const int w = area.getWidth();
+        const uint8_t* origin = surface.getData(area.getUL());
+        const int32_t rowBytes = surface.getRowBytes();
+
+        uint32_t sub[4][kBins];
+        memset(sub, 0, sizeof(sub));
+
+        uint32_t counted = 0;
+        int k = 0;
+#if COLOR_HISTOGRAM_SSE2
+        // Addresses are exact in float below 2^24 bytes.
+        if (pixelInc == 4 && int64_t(area.getHeight()) * rowBytes < (1 << 24))
+        {
+            const __m128i rShift = _mm_cvtsi32_si128(rOff * 8);
+            const __m128i gShift = _mm_cvtsi32_si128(gOff * 8);
+            const __m128i bShift = _mm_cvtsi32_si128(bOff * 8);
+            const __m128 widthF = _mm_set1_ps(float(w));
+            const __m128 invWidth = _mm_set1_ps(1.0f / w);
+            const __m128 rowBytesF = _mm_set1_ps(float(rowBytes));
+            const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), four = _mm_set1_ps(4.0f);
+            alignas(16) int32_t addr[4];
+            alignas(16) uint32_t idx[4];
+            for (; k + 4 <= count; k += 4)
+            {
+                __m128i offset = _mm_loadu_si128(reinterpret_cast<const __m128i*>(offsets + k));
+                // Groups with skipped entries take the scalar path.
+                if (_mm_movemask_epi8(_mm_cmplt_epi32(offset, _mm_setzero_si128())))
+                {
+                    for (int j = k; j < k + 4; j++)
+                    {
+                        if (offsets[j] < 0) continue;
+                        const uint8_t* p = origin + (offsets[j] / w) * rowBytes + (offsets[j] % w) * 4;
+                        sub[counted & 3][((p[rOff] >> 6) << 4) | ((p[gOff] >> 6) << 2) | (p[bOff] >> 6)]++;
+                        counted++;
+                    }
+                    continue;
+                }
+
+                // y = offset / w, off by at most one from the rounding of invWidth, fixed up through x.
+                __m128 o = _mm_cvtepi32_ps(offset);
+                __m128 y = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(o, invWidth)));
+                __m128 x = _mm_sub_ps(o, _mm_mul_ps(y, widthF));
+                __m128 under = _mm_cmplt_ps(x, zero);
+                y = _mm_sub_ps(y, _mm_and_ps(under, one));
+                x = _mm_add_ps(x, _mm_and_ps(under, widthF));
+                __m128 over = _mm_cmpge_ps(x, widthF);
+                y = _mm_add_ps(y, _mm_and_ps(over, one));
+                x = _mm_sub_ps(x, _mm_and_ps(over, widthF));
+                __m128 a = _mm_add_ps(_mm_mul_ps(y, rowBytesF), _mm_mul_ps(x, four));
+                _mm_store_si128(reinterpret_cast<__m128i*>(addr), _mm_cvtps_epi32(a));
+
+                int32_t px4[4];
+                for (int j = 0; j < 4; j++) memcpy(&px4[j], origin + addr[j], 4);
+                __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px4));
+                _mm_store_si128(reinterpret_cast<__m128i*>(idx), binsOf4(px, rShift, gShift, bShift));
+                sub[0][idx[0]]++;
+                sub[1][idx[1]]++;
+                sub[2][idx[2]]++;
+                sub[3][idx[3]]++;
+                counted += 4;
+            }
+        }
+#endif
+        for (; k < count; k++)
+        {
+            int32_t offset = offsets[k];
+            if (offset < 0) continue;
+            const uint8_t* p = origin + (offset / w) * rowBytes + (offset % w) * pixelInc;
+            int bin = ((p[rOff] >> 6) << 4) | ((p[gOff] >> 6) << 2) | (p[bOff] >> 6);
+            sub[counted & 3][bin]++;
+            counted++;
+        }
+
+        for (int i = 0; i < kBins; i++)
+        {
+            bins[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+        }
+        total = counted;
+    }
+
+#if COLOR_HISTOGRAM_SSE2
+    // Bin index of 4 pixels of 4 bytes, the channel shifts are the byte offsets * 8.
+    static __m128i binsOf4(__m128i px, __m128i rShift, __m128i gShift, __m128i bShift)
+    {
+        const __m128i mask = _mm_set1_epi32(0x03030303);
+        const __m128i three = _mm_set1_epi32(3);
+        // Top two bits of every byte, in place.
+        __m128i q = _mm_and_si128(_mm_srli_epi32(px, 6), mask);
+        __m128i r = _mm_and_si128(_mm_srl_epi32(q, rShift), three);
+        __m128i g = _mm_and_si128(_mm_srl_epi32(q, gShift), three);
+        __m128i b = _mm_and_si128(_mm_srl_epi32(q, bShift), three);
+        return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 4), _mm_slli_epi32(g, 2)), b);
+    }
+#endif
+
+    // Normalized histogram intersection, 1 for identical color distributions, 0 for disjoint ones.
+    float similarity(const ColorHistogram& other) const
+    {
+        if (total == 0 || other.total == 0) return 0;
+
+        float scaleA = 1.0f / total, scaleB = 1.0f / other.total;
+        float sum = 0;
+        for (int i = 0; i < kBins; i++)
+        {
+            sum += std::min(bins[i] * scaleA, other.bins[i] * scaleB);
+        }
+        return sum;
+    }
+};
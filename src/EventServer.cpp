@@ -0,0 +1,266 @@
+#include "EventServer.h"
+#include "Metrics.h"
+
+#include "cinder/Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+using std::vector;
+using asio::ip::tcp;
+
+// A subscriber this far behind is dropped instead of buffering for it without bound.
+static const size_t kMaxQueuedMessages = 1024;
+
+static void putU16(vector<uint8_t>& buf, uint16_t v)
+{
+    buf.push_back(v & 0xff);
+    buf.push_back(v >> 8);
+}
+
+static void putU32(vector<uint8_t>& buf, uint32_t v)
+{
+    putU16(buf, v & 0xffff);
+    putU16(buf, v >> 16);
+}
+
+class EventServer::Session : public std::enable_shared_from_this<EventServer::Session>
+{
+public:
+    Session(EventServer* server, tcp::socket socket)
+        : mServer(server), mSocket(std::move(socket))
+    {
+        asio::error_code ec;
+        mSocket.set_option(tcp::no_delay(true), ec);
+    }
+
+    void start()
+    {
+        doRead();
+    }
+
+    void send(MessageRef msg)
+    {
+        if (!mSocket.is_open()) return;
+
+        // Only the newest occupancy frame is worth delivering, replace a stale one still waiting.
+        // The front message may be in flight and stays.
+        if ((*msg)[0] == MSG_OCCUPANCY)
+        {
+            auto stale = std::find_if(mQueue.begin() + std::min<size_t>(mQueue.size(), 1), mQueue.end(),
+                [](const MessageRef& m) { return (*m)[0] == MSG_OCCUPANCY; });
+            if (stale != mQueue.end()) mQueue.erase(stale);
+        }
+
+        if (mQueue.size() >= kMaxQueuedMessages)
+        {
+            // The pending handlers see the closed socket and remove the session.
+            Metrics::get().eventSubscribersDropped.inc();
+            close();
+            return;
+        }
+
+        bool idle = mQueue.empty();
+        mQueue.push_back(msg);
+        if (idle) doWrite();
+    }
+
+    void close()
+    {
+        asio::error_code ec;
+        mSocket.close(ec);
+    }
+
+private:
+    // Subscribers never send anything meaningful, reading only detects the hang up.
+    void doRead()
+    {
+        auto self = shared_from_this();
+        mSocket.async_read_some(asio::buffer(mReadBuf), [this, self](asio::error_code ec, size_t)
+        {
+            if (ec) mServer->removeSession(this);
+            else doRead();
+        });
+    }
+
+    void doWrite()
+    {
+        auto self = shared_from_this();
+        asio::async_write(mSocket, asio::buffer(*mQueue.front()), [this, self](asio::error_code ec, size_t)
+        {
+            if (ec)
+            {
+                mServer->removeSession(this);
+                return;
+            }
+            mQueue.pop_front();
+            if (!mQueue.empty()) doWrite();
+        });
+    }
+
+    EventServer* mServer;
+    tcp::socket mSocket;
+    std::deque<MessageRef> mQueue;
+    uint8_t mReadBuf[64];
+};
+
+EventServer::EventServer()
+    : mAcceptor(mIo), mPendingSocket(mIo), mAcceptRetry(mIo), mSubscriberCount(0)
+{
+}
+
+EventServer::~EventServer()
+{
+    stop();
+}
+
+bool EventServer::start(int port)
+{
+    stop();
+
+    asio::error_code ec;
+    tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+    mAcceptor.open(endpoint.protocol(), ec);
+    if (!ec) mAcceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+    if (!ec) mAcceptor.bind(endpoint, ec);
+    if (!ec) mAcceptor.listen(asio::socket_base::max_connections, ec);
+    if (ec)
+    {
+        mAcceptor.close(ec);
+        return false;
+    }
+
+    mIo.reset();
+    mWork.reset(new asio::io_service::work(mIo));
+    doAccept();
+    mThread = std::thread([this] { mIo.run(); });
+    return true;
+}
+
+void EventServer::stop()
+{
+    if (!mThread.joinable()) return;
+
+    mIo.post([this]
+    {
+        asio::error_code ec;
+        mAcceptor.close(ec);
+        mAcceptRetry.cancel(ec);
+        for (auto& session : mSessions) session->close();
+        mSessions.clear();
+        mItemStates.clear();
+        mSubscriberCount = 0;
+    });
+    mWork.reset();
+    mThread.join();
+}
+
+vector<uint8_t> EventServer::beginMessage(MessageType type, size_t payloadSize)
+{
+    vector<uint8_t> buf;
+    buf.reserve(4 + payloadSize);
+    buf.push_back(type);
+    buf.push_back(0);
+    putU16(buf, payloadSize);
+    return buf;
+}
+
+void EventServer::publishItemState(int index, const std::string& name, bool isUsing, int usedCount, int blobId)
+{
+    if (!mThread.joinable()) return;
+
+    size_t nameLength = std::min<size_t>(name.size(), 255);
+    auto buf = beginMessage(MSG_ITEM_STATE, 2 + 1 + 4 + 4 + 1 + nameLength);
+    putU16(buf, index);
+    buf.push_back(isUsing ? 1 : 0);
+    putU32(buf, usedCount);
+    putU32(buf, blobId);
+    buf.push_back(nameLength);
+    buf.insert(buf.end(), name.begin(), name.begin() + nameLength);
+
+    auto msg = std::make_shared<const vector<uint8_t>>(std::move(buf));
+    mIo.post([this, index, msg]
+    {
+        mItemStates[index] = msg;
+        broadcast(msg);
+    });
+}
+
+void EventServer::publishItemsReset()
+{
+    if (!mThread.joinable()) return;
+
+    auto msg = std::make_shared<const vector<uint8_t>>(beginMessage(MSG_ITEMS_RESET, 0));
+    mIo.post([this, msg]
+    {
+        mItemStates.clear();
+        broadcast(msg);
+    });
+}
+
+void EventServer::publishOccupancy(uint32_t frameIndex, const vector<uint16_t>& occupancy)
+{
+    // Per-frame traffic is only worth encoding when somebody listens.
+    if (!mThread.joinable() || mSubscriberCount == 0) return;
+
+    size_t count = std::min<size_t>(occupancy.size(), (0xffff - 6) / 2);
+    auto buf = beginMessage(MSG_OCCUPANCY, 4 + 2 + count * 2);
+    putU32(buf, frameIndex);
+    putU16(buf, count);
+    for (size_t i = 0; i < count; i++) putU16(buf, occupancy[i]);
+
+    auto msg = std::make_shared<const vector<uint8_t>>(std::move(buf));
+    mIo.post([this, msg] { broadcast(msg); });
+}
+
+void EventServer::doAccept()
+{
+    mAcceptor.async_accept(mPendingSocket, [this](asio::error_code ec)
+    {
+        if (ec)
+        {
+            // Aborted by stop(), otherwise e.g. out of file descriptors: keep listening after a short pause.
+            if (ec == asio::error::operation_aborted || !mAcceptor.is_open()) return;
+            CI_LOG_W("Event server accept failed: " << ec.message());
+            mAcceptRetry.expires_from_now(std::chrono::milliseconds(100));
+            mAcceptRetry.async_wait([this](asio::error_code ec)
+            {
+                if (!ec && mAcceptor.is_open()) doAccept();
+            });
+            return;
+        }
+
+        auto session = std::make_shared<Session>(this, std::move(mPendingSocket));
+        mSessions.push_back(session);
+        mSubscriberCount = mSessions.size();
+        session->start();
+        // The replay is every MSG_ITEM_STATE back to back in one buffer, the same bytes as separate messages,
+        // so a large item table takes one queue slot instead of tripping kMaxQueuedMessages.
+        if (!mItemStates.empty())
+        {
+            vector<uint8_t> replay;
+            for (auto& kv : mItemStates) replay.insert(replay.end(), kv.second->begin(), kv.second->end());
+            session->send(std::make_shared<const vector<uint8_t>>(std::move(replay)));
+        }
+
+        mPendingSocket = tcp::socket(mIo);
+        doAccept();
+    });
+}
+
+void EventServer::broadcast(MessageRef msg)
+{
+    for (auto& session : mSessions) session->send(msg);
+}
+
+void EventServer::removeSession(Session* session)
+{
+    auto it = std::find_if(mSessions.begin(), mSessions.end(),
+        [session](const SessionRef& s) { return s.get() == session; });
+    if (it == mSessions.end()) return;
+
+    (*it)->close();
+    mSessions.erase(it);
+    mSubscriberCount = mSessions.size();
+}
@@ -0,0 +1,85 @@
+/*
+* EventServer.h
+*
+* Pushes item events to local subscribers over persistent loopback TCP
+* connections, so consumers don't pay a connection setup per event.
+*
+* Every message is a 4 byte header followed by the payload, little endian:
+*
+*   u8 type | u8 reserved | u16 payload length | payload
+*
+*   MSG_ITEM_STATE   u16 index | u8 isUsing | u32 usedCount | i32 blobId | u8 nameLength | name
+*   MSG_OCCUPANCY    u32 frame | u16 itemCount | u16 occupancy[itemCount] (ratio * 65535)
+*   MSG_ITEMS_RESET  (empty) the item table changed, drop cached states
+*
+* blobId is the tracked arm that last reached over the item, -1 if none.
+* A new subscriber first receives the latest MSG_ITEM_STATE of every item.
+* Messages are encoded on the calling thread and written by a background
+* io thread, so publishing never blocks the frame loop. A slow subscriber
+* only ever has the newest MSG_OCCUPANCY queued and is disconnected once
+* 1024 messages are waiting for it.
+*
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include "asio/asio.hpp"
+
+class EventServer
+{
+public:
+    enum MessageType
+    {
+        MSG_ITEM_STATE = 1,
+        MSG_OCCUPANCY = 2,
+        MSG_ITEMS_RESET = 3,
+    };
+
+    EventServer();
+    ~EventServer();
+
+    // Listens on 127.0.0.1:port, returns false if the port can't be bound.
+    bool start(int port);
+    void stop();
+
+    // All publish calls are thread-safe.
+    void publishItemState(int index, const std::string& name, bool isUsing, int usedCount, int blobId = -1);
+    void publishItemsReset();
+    void publishOccupancy(uint32_t frameIndex, const std::vector<uint16_t>& occupancy);
+
+    int getSubscriberCount() const { return mSubscriberCount; }
+
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> MessageRef;
+    class Session;
+    typedef std::shared_ptr<Session> SessionRef;
+
+    static std::vector<uint8_t> beginMessage(MessageType type, size_t payloadSize);
+
+    void doAccept();
+    void broadcast(MessageRef msg);
+    void removeSession(Session* session);
+
+    asio::io_service mIo;
+    std::unique_ptr<asio::io_service::work> mWork;
+    asio::ip::tcp::acceptor mAcceptor;
+    asio::ip::tcp::socket mPendingSocket;
+    asio::steady_timer mAcceptRetry;
+    std::thread mThread;
+
+    // Only touched on the io thread.
+    std::vector<SessionRef> mSessions;
+    std::map<int, MessageRef> mItemStates;
+
+    std::atomic<int> mSubscriberCount;
+};
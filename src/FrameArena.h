@@ -0,0 +1,255 @@
+/*
+* FrameArena.h
+*
+* Two allocators for the detection path:
+*
+* - FrameArena is a bump allocator for scratch data that only lives for one
+*   depth frame (process channels, the depth-as-rgb surface). reset() is
+*   called at the start of every frame and is O(1). When a frame overflows
+*   the current block, the overflow is served by extra blocks and the next
+*   reset() folds them into one block big enough for the whole frame, so the
+*   arena stops touching the heap after the first few frames.
+*
+* - BufferPool recycles long-lived item buffers (background depth and color
+*   snapshots) in power-of-two size classes, so editing an ROI or refreshing
+*   an item reuses memory instead of allocating a new Channel/Surface.
+*
+* Every time one of them has to go to the heap for a buffer it bumps
+* AllocStats::arenaMisses, which the app shows in the config window. In steady
+* state it should stay flat. It only counts these two allocators.
+*
+* AllocStats::threadHeapAllocs counts every operator new of the calling thread,
+* so it also sees STL containers, strings and std::function. The counting
+* operator new is only compiled into debug builds (see KinServerApp.cpp), in
+* release builds the counter stays 0. OpenCV allocates Mat data with its own
+* fastMalloc, which neither counter sees.
+*
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct AllocStats
+{
+    static std::atomic<int>& arenaMisses()
+    {
+        static std::atomic<int> count(0);
+        return count;
+    }
+
+    static size_t& threadHeapAllocs()
+    {
+        static thread_local size_t count = 0;
+        return count;
+    }
+};
+
+class FrameArena
+{
+public:
+    explicit FrameArena(size_t blockSize = 4 * 1024 * 1024)
+    {
+        mBlocks.reserve(8);
+        addBlock(blockSize);
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Returns uninitialized storage for count elements of T, valid until the next reset().
+    template <typename T>
+    T* allocate(size_t count, size_t alignment = 16)
+    {
+        size_t bytes = count * sizeof(T);
+        Block* block = &mBlocks.back();
+        size_t offset = alignUp(block->used, alignment);
+        if (offset + bytes > block->size)
+        {
+            addBlock(std::max(bytes + alignment, block->size));
+            block = &mBlocks.back();
+            offset = alignUp(block->used, alignment);
+        }
+        block->used = offset + bytes;
+        // Worst case footprint of this frame if it had to fit in a single block.
+        mFrameBytes += bytes + alignment;
+        mPeakBytes = std::max(mPeakBytes, mFrameBytes);
+        return reinterpret_cast<T*>(block->data.get() + offset);
+    }
+
+    void reset()
+    {
+        if (mBlocks.size() > 1)
+        {
+            // Last frame did not fit, grow to the peak so the next one does.
+            size_t size = mPeakBytes;
+            mBlocks.clear();
+            addBlock(size);
+        }
+        mBlocks.back().used = 0;
+        mFrameBytes = 0;
+    }
+
+    size_t usedBytes() const
+    {
+        size_t bytes = 0;
+        for (const auto& block : mBlocks) bytes += block.used;
+        return bytes;
+    }
+
+    size_t capacity() const
+    {
+        size_t bytes = 0;
+        for (const auto& block : mBlocks) bytes += block.size;
+        return bytes;
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+        size_t used;
+    };
+
+    static size_t alignUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    void addBlock(size_t size)
+    {
+        Block block;
+        block.data.reset(new uint8_t[size]);
+        block.size = size;
+        block.used = 0;
+        mBlocks.push_back(std::move(block));
+        AllocStats::arenaMisses()++;
+    }
+
+    std::vector<Block> mBlocks;
+    size_t mFrameBytes = 0;
+    size_t mPeakBytes = 0;
+};
+
+class BufferPool;
+
+// Move-only handle to a pooled buffer, returns its memory to the pool on destruction.
+class PooledBuffer
+{
+public:
+    PooledBuffer() = default;
+    PooledBuffer(PooledBuffer&& rhs) noexcept : mPool(rhs.mPool), mData(rhs.mData), mCapacity(rhs.mCapacity)
+    {
+        rhs.mPool = nullptr;
+        rhs.mData = nullptr;
+        rhs.mCapacity = 0;
+    }
+    PooledBuffer& operator=(PooledBuffer&& rhs) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer() { release(); }
+
+    // Makes sure the buffer holds at least bytes, keeping the current block if it is big enough.
+    uint8_t* reserve(BufferPool& pool, size_t bytes);
+    void release();
+
+    uint8_t* data() const { return mData; }
+    size_t capacity() const { return mCapacity; }
+
+private:
+    BufferPool* mPool = nullptr;
+    uint8_t*    mData = nullptr;
+    size_t      mCapacity = 0;
+};
+
+class BufferPool
+{
+public:
+    BufferPool()
+    {
+        for (auto& bucket : mFreeLists) bucket.reserve(16);
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool()
+    {
+        for (auto& bucket : mFreeLists)
+            for (auto* data : bucket) delete[] data;
+    }
+
+    uint8_t* acquire(size_t bytes, size_t* capacity)
+    {
+        int bucket = bucketOf(bytes);
+        *capacity = bucketSize(bucket);
+        auto& freeList = mFreeLists[bucket];
+        if (!freeList.empty())
+        {
+            uint8_t* data = freeList.back();
+            freeList.pop_back();
+            return data;
+        }
+        AllocStats::arenaMisses()++;
+        return new uint8_t[*capacity];
+    }
+
+    void release(uint8_t* data, size_t capacity)
+    {
+        auto& freeList = mFreeLists[bucketOf(capacity)];
+        freeList.push_back(data);
+    }
+
+private:
+    static const int kMinBucketBits = 12; // 4 KB
+    static const int kBucketCount = 20;   // up to 2 GB
+
+    static int bucketOf(size_t bytes)
+    {
+        int bucket = 0;
+        while (bucketSize(bucket) < bytes && bucket < kBucketCount - 1) bucket++;
+        return bucket;
+    }
+
+    static size_t bucketSize(int bucket)
+    {
+        return size_t(1) << (kMinBucketBits + bucket);
+    }
+
+    std::vector<uint8_t*> mFreeLists[kBucketCount];
+};
+
+inline PooledBuffer& PooledBuffer::operator=(PooledBuffer&& rhs) noexcept
+{
+    if (this != &rhs)
+    {
+        release();
+        mPool = rhs.mPool;
+        mData = rhs.mData;
+        mCapacity = rhs.mCapacity;
+        rhs.mPool = nullptr;
+        rhs.mData = nullptr;
+        rhs.mCapacity = 0;
+    }
+    return *this;
+}
+
+inline uint8_t* PooledBuffer::reserve(BufferPool& pool, size_t bytes)
+{
+    if (mData && mCapacity >= bytes && mPool == &pool) return mData;
+    release();
+    mPool = &pool;
+    mData = pool.acquire(bytes, &mCapacity);
+    return mData;
+}
+
+inline void PooledBuffer::release()
+{
+    if (mData) mPool->release(mData, mCapacity);
+    mPool = nullptr;
+    mData = nullptr;
+    mCapacity = 0;
+}
@@ -6,7 +6,10 @@
 #include "cinder/Json.h"
 #include "cinder/Url.h"
 #include "cinder/Utilities.h"
+#include "cinder/Timer.h"
 
+#include <cstdlib>
+#include <new>
 #include <vector>
 
 #include "DepthSensor.h"
@@ -16,11 +19,48 @@
 #include "Cinder-VNM/include/FontHelper.h"
 
 #include "CinderImGui.h"
+#include "CinderOpenCV.h"
+
+#include "FrameArena.h"
+#include "EventServer.h"
+#include "StatusServer.h"
+#include "Metrics.h"
+#include "ColorHistogram.h"
+#include "BlobTracker.h"
+#include "RectIndex.h"
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 
+#ifndef NDEBUG
+// Counts heap allocations per thread so the profiler can show what a depth frame allocates.
+void* operator new(size_t size)
+{
+    AllocStats::threadHeapAllocs()++;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    AllocStats::threadHeapAllocs()++;
+    return malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+#endif
+
+// Long-lived storage for item background snapshots.
+static BufferPool& getItemPool()
+{
+    static BufferPool pool;
+    return pool;
+}
+
 struct MonitorItem
 {
     string	name;
@@ -29,10 +69,19 @@ struct MonitorItem
     gl::Texture2dRef depthTex;
     gl::Texture2dRef colorTex;
     gl::Texture2dRef processTex;
-    Channel16u depthChannel;
-    Surface colorSurface;
-    Channel8u processChannel;
+    Channel16u depthChannel;    // views into depthBuffer
+    Surface colorSurface;       // views into colorBuffer
+    PooledBuffer depthBuffer;
+    PooledBuffer colorBuffer;
+    Area colorArea;             // color pixels covered by the ROI
+    ivec2 colorLookupSize;      // ROI size if colorLookupBuffer is valid, zero otherwise
+    PooledBuffer colorLookupBuffer;
+    ColorHistogram colorHistogram; // of colorSurface, cached on refresh
     int itemUsedCount = 0;
+    int stateFlips = 0;
+    int handSettleFrames = 0;   // frames to wait after an arm left the ROI
+    bool isHandOver = false;
+    int lastBlobId = -1;        // tracked arm that most recently overlapped the ROI
     bool isItemUsing = false;
 
     void notifyHTTPStatus()
@@ -42,31 +91,58 @@ struct MonitorItem
             SERVER_ADDR.c_str(), SERVER_PORT,
             isItemUsing ? "pickup" : "return",
             name.c_str());
-        auto url = loadUrl(Url(urlName));
-        auto str = loadString(url);
-        CI_LOG_I(urlName);
-        CI_LOG_I(str);
+        if (lastBlobId >= 0)
+        {
+            sprintf(urlName + strlen(urlName), "?blob=%d", lastBlobId);
+        }
+        MetricTimer timer(Metrics::get().httpNotifySeconds);
+        try
+        {
+            auto url = loadUrl(Url(urlName));
+            auto str = loadString(url);
+            CI_LOG_I(urlName);
+            CI_LOG_I(str);
+        }
+        catch (Exception& e)
+        {
+            Metrics::get().httpNotifyFailures.inc();
+            CI_LOG_EXCEPTION(urlName, e);
+        }
     }
 
-    void updateItemUsing(bool changeState)
+    // Returns true if the item flipped between "being used" and "still there".
+    bool updateItemUsing(bool changeState)
     {
+        if (!changeState) return false;
+
         if (isItemUsing)
         {
-            if (changeState)
-            {
-                isItemUsing = false;
-                notifyHTTPStatus();
-            }
+            isItemUsing = false;
         }
         else
         {
-            if (changeState)
-            {
-                isItemUsing = true;
-                notifyHTTPStatus();
-                itemUsedCount++;
-            }
+            isItemUsing = true;
+            itemUsedCount++;
         }
+        stateFlips++;
+        Metrics::get().itemStateFlips.inc();
+        if (HTTP_NOTIFY) notifyHTTPStatus();
+        return true;
+    }
+
+    // Second opinion from the color camera, only asked when depth wants to flip the state.
+    // A pickup should expose something that doesn't look like the item, a return should bring its colors back.
+    bool verifyColorChange(const Surface& liveColor) const
+    {
+        ColorHistogram live;
+        computeColorHistogram(live, liveColor, colorArea);
+        if (colorHistogram.total == 0 || live.total == 0) return true;
+
+        float similarity = colorHistogram.similarity(live);
+        if (isItemUsing)
+            return similarity >= COLOR_RETURN_MIN_SIMILARITY;
+        else
+            return similarity <= COLOR_PICKUP_MAX_SIMILARITY;
     }
 
     JsonTree write()
@@ -76,7 +152,7 @@ struct MonitorItem
         if (depthChannel.getWidth() > 0)
         {
             writeImage(depthPath, depthChannel);
-            writeImage(colorPath, colorSurface);
+            if (colorSurface.getWidth() > 0) writeImage(colorPath, colorSurface);
         }
 
         JsonTree tree;
@@ -103,9 +179,10 @@ struct MonitorItem
         size.y = tree.getValueForKey<float>("size_y");
         itemUsedCount = tree.getValueForKey<int>("itemUsedCount");
 
-        depthChannel = am::channel16u(depthPath)->clone();
-        colorSurface = am::surface(colorPath)->clone();
-        processChannel = { depthChannel.getWidth(), depthChannel.getHeight() };
+        auto depth = am::channel16u(depthPath);
+        auto color = am::surface(colorPath);
+        copyDepth(*depth, depth->getBounds());
+        copyColor(*color, color->getBounds());
 
         _createTex();
 
@@ -117,28 +194,143 @@ struct MonitorItem
         return Rectf(pos.x, pos.y, pos.x + size.x, pos.y + size.y);
     }
 
-    void update(const Channel16u& depth, const Surface& color)
+    void update(const Channel16u& depth, const Surface& color, const Surface32f& depthToColorTable)
     {
-        depthChannel = depth.clone(Area(getRect()), true);
-        processChannel = { size.x, size.y };
-
-        auto rect = getRect();
-        float xScale = color.getWidth() / (float)depth.getWidth();
-        float yScale = color.getHeight() / (float)depth.getHeight();
-        rect.x1 *= xScale;
-        rect.x2 *= xScale;
-        rect.y1 *= yScale;
-        rect.y2 *= yScale;
-        colorSurface = color.clone(Area(rect), true);
+        copyDepth(depth, Area(getRect()));
+        updateColorMap(depthToColorTable, depth.getSize(), color.getSize());
+        copyColor(color, colorArea);
 
         _createTex();
     }
 
+    // Maps every ROI pixel through the sensor's depth-to-color table (the one colorMap.fs samples),
+    // caching the tight color bounding box and, per ROI pixel, its index inside that box or -1.
+    // Falls back to linear scaling when the sensor provides no table.
+    // The color snapshot and both histograms only read the pixels of the box listed in the lookup.
+    void updateColorMap(const Surface32f& table, ivec2 depthSize, ivec2 colorSize)
+    {
+        Area roi(getRect());
+        roi.clipBy(Area(ivec2(0), depthSize));
+        colorLookupSize = roi.getSize();
+
+        if (table.getSize() != depthSize)
+        {
+            Rectf rect(roi);
+            rect.scale(vec2(colorSize) / vec2(depthSize));
+            colorArea = Area(rect);
+            colorArea.clipBy(Area(ivec2(0), colorSize));
+            colorLookupSize = {};
+            computeColorHistogram(colorHistogram, colorSurface, colorSurface.getBounds());
+            return;
+        }
+
+        int w = roi.getWidth(), h = roi.getHeight();
+        auto lookup = reinterpret_cast<int32_t*>(colorLookupBuffer.reserve(getItemPool(), w * h * sizeof(int32_t)));
+        uint8_t redOffset = table.getRedOffset(), greenOffset = table.getGreenOffset();
+        ivec2 lo(colorSize), hi(-1);
+        for (int j = 0; j < h; j++)
+        {
+            for (int i = 0; i < w; i++)
+            {
+                const float* uv = table.getData(roi.getUL() + ivec2(i, j));
+                float u = uv[redOffset], v = uv[greenOffset];
+                int32_t& entry = lookup[j * w + i];
+                entry = -1;
+                // The table is normalized and top-down, colorMap.fs only flips v for GL.
+                if (!(u >= 0 && u < 1 && v >= 0 && v < 1)) continue;
+
+                ivec2 c(int(u * colorSize.x), int(v * colorSize.y));
+                lo = glm::min(lo, c);
+                hi = glm::max(hi, c);
+                entry = (c.y << 16) | c.x;
+            }
+        }
+
+        if (hi.x < lo.x)
+        {
+            // Nothing in the ROI has a color pixel, e.g. the ROI sits in a depth hole.
+            colorArea = Area();
+            colorLookupSize = {};
+            computeColorHistogram(colorHistogram, colorSurface, colorSurface.getBounds());
+            return;
+        }
+
+        colorArea = Area(lo, hi + ivec2(1));
+        int colorW = colorArea.getWidth();
+        for (int k = 0; k < w * h; k++)
+        {
+            if (lookup[k] < 0) continue;
+            int cx = lookup[k] & 0xffff, cy = lookup[k] >> 16;
+            lookup[k] = (cy - lo.y) * colorW + (cx - lo.x);
+        }
+        // The snapshot may predate the lookup, e.g. right after read().
+        computeColorHistogram(colorHistogram, colorSurface, colorSurface.getBounds());
+    }
+
+    // True if colorLookupBuffer indexes the pixels of an image of colorArea's size.
+    bool hasColorLookup(ivec2 imageSize) const
+    {
+        return colorLookupSize.x > 0 && imageSize == colorArea.getSize();
+    }
+
+    // Histogram of area of src, or of the mapped ROI pixels only when area is the (copied) colorArea.
+    void computeColorHistogram(ColorHistogram& hist, const Surface& src, const Area& area) const
+    {
+        auto lookup = reinterpret_cast<const int32_t*>(colorLookupBuffer.data());
+        if (hasColorLookup(area.getSize()))
+            hist.compute(src, area, lookup, colorLookupSize.x * colorLookupSize.y);
+        else
+            hist.compute(src, area);
+    }
+
+    // Copies area of src into the pooled depth buffer, reusing it when it is large enough.
+    void copyDepth(const Channel16u& src, Area area)
+    {
+        area.clipBy(src.getBounds());
+        int w = area.getWidth(), h = area.getHeight();
+        auto data = depthBuffer.reserve(getItemPool(), w * h * sizeof(uint16_t));
+        depthChannel = Channel16u(w, h, w * sizeof(uint16_t), 1, reinterpret_cast<uint16_t*>(data));
+        depthChannel.copyFrom(src, area, -area.getUL());
+    }
+
+    void copyColor(const Surface& src, Area area)
+    {
+        area.clipBy(src.getBounds());
+        if (area.calcArea() == 0)
+        {
+            colorSurface = Surface();
+            colorHistogram.clear();
+            return;
+        }
+        int w = area.getWidth(), h = area.getHeight();
+        int pixelInc = src.getPixelInc();
+        auto data = colorBuffer.reserve(getItemPool(), w * h * pixelInc);
+        colorSurface = Surface(data, w, h, w * pixelInc, src.getChannelOrder());
+        if (area == colorArea && hasColorLookup(area.getSize()))
+        {
+            // Only the color pixels the ROI maps to, the rest of the box stays black.
+            memset(data, 0, w * h * pixelInc);
+            auto lookup = reinterpret_cast<const int32_t*>(colorLookupBuffer.data());
+            const uint8_t* origin = src.getData(area.getUL());
+            int32_t rowBytes = src.getRowBytes();
+            for (int k = 0; k < colorLookupSize.x * colorLookupSize.y; k++)
+            {
+                int32_t offset = lookup[k];
+                if (offset < 0) continue;
+                memcpy(data + offset * pixelInc, origin + (offset / w) * rowBytes + (offset % w) * pixelInc, pixelInc);
+            }
+        }
+        else
+        {
+            colorSurface.copyFrom(src, area, -area.getUL());
+        }
+        computeColorHistogram(colorHistogram, colorSurface, colorSurface.getBounds());
+    }
+
     void _createTex()
     {
         updateTexture(depthTex, depthChannel, getTextureFormatUINT16());
-        updateTexture(colorTex, colorSurface);
-        updateTexture(processTex, processChannel);
+        if (colorSurface.getWidth() > 0) updateTexture(colorTex, colorSurface);
     }
 };
 
@@ -164,6 +356,15 @@ public:
         readConfig();
         createConfigImgui();
 
+        if (!mEventServer.start(EVENT_SERVER_PORT))
+        {
+            CI_LOG_E("Failed to listen for event subscribers on port " << EVENT_SERVER_PORT);
+        }
+        if (!mStatusServer.start(STATUS_SERVER_PORT))
+        {
+            CI_LOG_E("Failed to start status server on port " << STATUS_SERVER_PORT);
+        }
+
         ds::DeviceType type = ds::DeviceType(_SENSOR_TYPE);
         ds::Option option;
         option.enableColor = true;
@@ -187,6 +388,15 @@ public:
                 .dataType(GL_FLOAT)
                 .immutableStorage();
             updateTexture(mDepthToColorTableTexture, mDevice->depthToColorTable, format);
+
+            // The old color snapshot covers the old mapping, take a new one like update() does
+            // so the cached and live histograms keep looking at the same pixels.
+            for (auto& item : mItems)
+            {
+                item.updateColorMap(mDevice->depthToColorTable, mDevice->getDepthSize(), mDevice->colorSurface.getSize());
+                item.copyColor(mDevice->colorSurface, item.colorArea);
+                item._createTex();
+            }
         });
 
         getWindow()->setSize(_WINDOW_WIDTH, _WINDOW_HEIGHT);
@@ -207,6 +417,8 @@ public:
 
     void cleanup()
     {
+        mEventServer.stop();
+        mStatusServer.stop();
         //onSaveItems();
         //writeConfig();
     }
@@ -297,6 +509,16 @@ public:
                 }
                 idx++;
             }
+
+            if (i == canvasIds[1])
+            {
+                gl::color(ColorA(1, 1, 0, 1));
+                for (const auto& blob : mBlobTracker.trackedBlobs)
+                {
+                    gl::drawStrokedRect(Rectf(blob.box.x, blob.box.y, blob.box.x + blob.box.width, blob.box.y + blob.box.height));
+                    mFont->drawString(toString(blob.id), vec2(blob.box.x, blob.box.y - 5));
+                }
+            }
         }
     }
 
@@ -316,6 +538,12 @@ public:
 
         mItems.clear();
 
+        auto shelfPath = getShelfDepthPath();
+        if (fs::exists(shelfPath))
+        {
+            mShelfDepth = am::channel16u(shelfPath.string())->clone();
+        }
+
         JsonTree itemsJson;
         try
         {
@@ -324,14 +552,29 @@ public:
             {
                 MonitorItem item;
                 if (!item.read(itemJson)) continue;
+                item.updateColorMap(mDevice->depthToColorTable, mDevice->getDepthSize(), mDevice->colorSurface.getSize());
 
-                mItems.emplace_back(item);
+                mItems.emplace_back(std::move(item));
             }
         }
         catch (JsonTree::Exception& e)
         {
             CI_LOG_EXCEPTION("Loading Json", e);
         }
+
+        publishAllItems();
+    }
+
+    // Called whenever items are added, removed or moved.
+    void publishAllItems()
+    {
+        mItemIndexDirty = true;
+        mEventServer.publishItemsReset();
+        int idx = 0;
+        for (const auto& item : mItems)
+        {
+            mEventServer.publishItemState(idx++, item.name, item.isItemUsing, item.itemUsedCount, item.lastBlobId);
+        }
     }
 
     void onSaveItems()
@@ -351,12 +594,26 @@ public:
         {
             writeString(itemsJsonPath, "{}");
         }
+
+        if (mShelfDepth.getWidth() > 0)
+        {
+            writeImage(getShelfDepthPath(), mShelfDepth);
+        }
+    }
+
+    fs::path getShelfDepthPath() const
+    {
+        return getAssetPath("") / "items" / "_shelf_depth.hdr";
     }
 
     void update() override
     {
         _FPS = getAverageFps();
 
+        int arenaMisses = AllocStats::arenaMisses();
+        _FRAME_ARENA_MISSES = arenaMisses - _ARENA_MISSES;
+        _ARENA_MISSES = arenaMisses;
+
         if (MIN_DEPTH_FOR_VIZ_MM > MAX_DEPTH_FOR_VIZ_MM) MIN_DEPTH_FOR_VIZ_MM = MAX_DEPTH_FOR_VIZ_MM;
 
         mDepthShader->uniform("uFlipX", FLIP_X);
@@ -395,9 +652,10 @@ public:
                 item.pos = { 100, 100 };
                 item.size = { 10, 10 };
                 item.name = "item" + to_string(objCount++);
-                item.update(mDevice->depthChannel, mDevice->colorSurface);
+                item.update(mDevice->depthChannel, mDevice->colorSurface, mDevice->depthToColorTable);
 
-                mItems.emplace_back(item);
+                mItems.emplace_back(std::move(item));
+                publishAllItems();
             }
             if (selectedItem != -1)
             {
@@ -406,6 +664,7 @@ public:
                 {
                     mItems.erase(mItems.begin() + selectedItem);
                     selectedItem = -1;
+                    publishAllItems();
                 }
             }
 
@@ -422,12 +681,16 @@ public:
 
             if (ui::Button("Refresh all"))
             {
+                // The same frame is the shelf reference for arm detection.
+                mShelfDepth = mDevice->depthChannel.clone();
                 for (auto& item : mItems)
                 {
-                    item.update(mDevice->depthChannel, mDevice->colorSurface);
+                    item.update(mDevice->depthChannel, mDevice->colorSurface, mDevice->depthToColorTable);
                     item.itemUsedCount = 0;
                     item.isItemUsing = false;
+                    item.lastBlobId = -1;
                 }
+                publishAllItems();
             }
 
 
@@ -451,6 +714,8 @@ public:
             MonitorItem& item = mItems[selectedItem];
             ui::InputText("name", &item.name);
             ui::Text(item.isItemUsing ? "being used" : "still there");
+            if (item.isHandOver) ui::Text("hand over item");
+            if (item.lastBlobId >= 0) ui::Text("last hand: %d", item.lastBlobId);
             ui::DragInt("used count", &item.itemUsedCount);
 
             bool posXChanged = ui::DragInt("x", &item.pos.x, 1, 0, mDepthW - item.size.x);
@@ -459,7 +724,8 @@ public:
             bool sizeYChanged = ui::DragInt("height", &item.size.y, 1, 0, mDepthH - item.pos.y);
             if (posXChanged || posYChanged || sizeXChanged || sizeYChanged)
             {
-                item.update(mDevice->depthChannel, mDevice->colorSurface);
+                item.update(mDevice->depthChannel, mDevice->colorSurface, mDevice->depthToColorTable);
+                mItemIndexDirty = true;
             }
 
             if (item.colorTex && item.depthTex)
@@ -475,10 +741,39 @@ public:
                 ui::Image(item.processTex, size);
             }
         }
+
+        publishSnapshot();
     }
 
 private:
 
+    // Hands the current item table to the status server, which reads it from its own thread.
+    void publishSnapshot()
+    {
+        auto& snapshot = mStatusServer.beginSnapshot();
+        snapshot.items.resize(mItems.size());
+        for (size_t i = 0; i < mItems.size(); i++)
+        {
+            const auto& item = mItems[i];
+            auto& state = snapshot.items[i];
+            state.name = item.name;
+            state.x = item.pos.x;
+            state.y = item.pos.y;
+            state.width = item.size.x;
+            state.height = item.size.y;
+            state.isUsing = item.isItemUsing;
+            state.usedCount = item.itemUsedCount;
+            state.stateFlips = item.stateFlips;
+            state.lastBlobId = item.lastBlobId;
+            state.occupancy = i < mOccupancy.size() ? mOccupancy[i] / 65535.0f : 0;
+        }
+        snapshot.fps = _FPS;
+        snapshot.frameIndex = mFrameIndex;
+        snapshot.subscribers = mEventServer.getSubscriberCount();
+        snapshot.arenaMisses = _ARENA_MISSES;
+        mStatusServer.publishSnapshot();
+    }
+
     void updateDepthRelated()
     {
         if (mDepthW == 0)
@@ -486,25 +781,51 @@ private:
             mDepthW = mDevice->getDepthSize().x;
             mDepthH = mDevice->getDepthSize().y;
         }
-        
+
+        auto& metrics = Metrics::get();
+        metrics.depthFramesReceived.inc();
+
+        // The sensor gives no frame numbers, so infer missed frames from the gap since the last one.
+        double now = getElapsedSeconds();
+        if (mLastDepthTime > 0 && DEPTH_SENSOR_FPS > 0)
+        {
+            int missed = int((now - mLastDepthTime) * DEPTH_SENSOR_FPS + 0.5) - 1;
+            if (missed > 0) metrics.depthFramesDropped.inc(missed);
+        }
+        mLastDepthTime = now;
+
+        if (mDevice->depthChannel.getWidth() == 0)
+        {
+            metrics.depthFramesDropped.inc();
+            return;
+        }
+
+        // Everything allocated from mFrameArena below is only valid for this frame.
+        mFrameArena.reset();
+        size_t heapAllocs = AllocStats::threadHeapAllocs();
+
+        Timer uploadTimer;
+        double uploadSeconds = 0;
+        double detectionSeconds = 0;
+
         if (!_DEPTH_AS_RGB)
         {
+            uploadTimer.start();
             updateTexture(mDepthTexture, mDevice->depthChannel, getTextureFormatUINT16());
+            uploadSeconds += uploadTimer.getSeconds();
         }
         else
         {
-            if (mDepthAsColorSurface.getWidth() == 0)
-            {
-                mDepthAsColorSurface = Surface(mDepthW, mDepthH, false, SurfaceChannelOrder::RGB);
-            }
-            
+            Surface depthAsColorSurface(mFrameArena.allocate<uint8_t>(mDepthW * mDepthH * 3),
+                mDepthW, mDepthH, mDepthW * 3, SurfaceChannelOrder::RGB);
+
             for (int y = 0; y < mDepthH; y++)
             {
                 for (int x = 0; x < mDepthW; x++)
                 {
                     uint16_t* src = mDevice->depthChannel.getData({x,y});
                     float t = math<uint16_t>::clamp(*src, 0, 4000) / 4000.0f;
-                    uint8_t* dst = mDepthAsColorSurface.getData({ x, y });
+                    uint8_t* dst = depthAsColorSurface.getData({ x, y });
                     
                     // https://twitter.com/Donzanoid/status/903424376707657730
                     vec3 r = vec3(t) * 2.1f - vec3(1.8f, 1.14f, 0.3f);
@@ -515,7 +836,9 @@ private:
                     dst[2] = r.z * 255;
                 }
             }
-            updateTexture(mDepthTexture, mDepthAsColorSurface);
+            uploadTimer.start();
+            updateTexture(mDepthTexture, depthAsColorSurface);
+            uploadSeconds += uploadTimer.getSeconds();
         }
         gl::checkError();
 
@@ -523,6 +846,12 @@ private:
         float minThresholdInDepthUnit = ITEM_HEIGHT_MM / depthToMmScale;
         float minThresholdBackInDepthUnit = ITEM_RETURN_ABSOLUTE_HEIGHT_MM / depthToMmScale;
 
+        Timer handTimer(true);
+        updateHandBlobs(depthToMmScale);
+        detectionSeconds += handTimer.getSeconds();
+
+        mOccupancy.resize(mItems.size());
+        int itemIdx = 0;
         for (auto& item : mItems)
         {
             int pixelCountThreshold = 0;
@@ -531,6 +860,10 @@ private:
             else
                 pixelCountThreshold = item.size.x * item.size.y * ITEM_RETURN_RATIO;
 
+            Channel8u processChannel(item.size.x, item.size.y, item.size.x, 1,
+                mFrameArena.allocate<uint8_t>(item.size.x * item.size.y));
+
+            Timer detectionTimer(true);
             int count = 0;
             for (int j = 0; j < item.size.y; j++)
             {
@@ -546,12 +879,12 @@ private:
                         auto diff = abs(dep - bg);
                         if (dep > 0 && diff < minThresholdBackInDepthUnit)
                         {
-                            *item.processChannel.getData(i, j) = diff & 0xff;
+                            *processChannel.getData(i, j) = diff & 0xff;
                             count++;
                         }
                         else
                         {
-                            *item.processChannel.getData(i, j) = 0;
+                            *processChannel.getData(i, j) = 0;
                         }
                     }
                     else
@@ -559,19 +892,117 @@ private:
                         auto diff = dep - bg;
                         if (dep > 0 && diff > minThresholdInDepthUnit)
                         {
-                            *item.processChannel.getData(i, j) = diff & 0xff;
+                            *processChannel.getData(i, j) = diff & 0xff;
                             count++;
                         }
                         else
                         {
-                            *item.processChannel.getData(i, j) = 0;
+                            *processChannel.getData(i, j) = 0;
                         }
 
                     }
                 }
             }
-            item.updateItemUsing(count > pixelCountThreshold);
-            updateTexture(item.processTex, item.processChannel);
+
+            bool changeState = count > pixelCountThreshold;
+            if (item.isHandOver)
+                item.handSettleFrames = HAND_SETTLE_FRAMES;
+            else if (item.handSettleFrames > 0)
+                item.handSettleFrames--;
+            if (changeState && (item.isHandOver || item.handSettleFrames > 0))
+            {
+                // Reaching in moves a lot of depth around, only commit once the arm has left.
+                metrics.handDeferredFrames.inc();
+                changeState = false;
+            }
+            if (changeState && COLOR_VERIFY && !item.verifyColorChange(mDevice->colorSurface))
+            {
+                metrics.colorVerifyRejections.inc();
+                changeState = false;
+            }
+            detectionSeconds += detectionTimer.getSeconds();
+
+            if (item.updateItemUsing(changeState))
+            {
+                mEventServer.publishItemState(itemIdx, item.name, item.isItemUsing, item.itemUsedCount, item.lastBlobId);
+            }
+            int area = item.size.x * item.size.y;
+            mOccupancy[itemIdx] = area > 0 ? uint16_t(int64_t(count) * 0xffff / area) : 0;
+            itemIdx++;
+
+            uploadTimer.start();
+            updateTexture(item.processTex, processChannel);
+            uploadSeconds += uploadTimer.getSeconds();
+        }
+
+        metrics.detectionSeconds.observe(detectionSeconds);
+        metrics.textureUploadSeconds.observe(uploadSeconds);
+
+        if (EVENT_STREAM_OCCUPANCY)
+        {
+            mEventServer.publishOccupancy(mFrameIndex, mOccupancy);
+        }
+        mFrameIndex++;
+        _FRAME_HEAP_ALLOCS = int(AllocStats::threadHeapAllocs() - heapAllocs);
+    }
+
+    // Everything closer to the sensor than the captured shelf is foreground, which on a shelf means arms.
+    void updateHandBlobs(float depthToMmScale)
+    {
+        mBlobs.clear();
+        const auto& depth = mDevice->depthChannel;
+        if (HAND_DETECTION && mShelfDepth.getSize() == depth.getSize())
+        {
+            Channel8u maskChannel(mDepthW, mDepthH, mDepthW, 1, mFrameArena.allocate<uint8_t>(mDepthW * mDepthH));
+            int minHeightInDepthUnit = HAND_MIN_HEIGHT_MM / depthToMmScale;
+            for (int y = 0; y < mDepthH; y++)
+            {
+                const uint16_t* dep = depth.getData(0, y);
+                const uint16_t* bg = mShelfDepth.getData(0, y);
+                uint8_t* dst = maskChannel.getData(0, y);
+                for (int x = 0; x < mDepthW; x++)
+                {
+                    dst[x] = (dep[x] > 0 && bg[x] > 0 && bg[x] - dep[x] > minHeightInDepthUnit) ? 255 : 0;
+                }
+            }
+
+            cv::Mat mask = toOcvRef(maskChannel);
+            mBlobOption.minArea = HAND_MIN_AREA;
+            mBlobOption.runLengthMode = true;   // only boxes and centers are used
+            BlobFinder::execute(mask, mBlobs, mBlobOption, mBlobWorkspace);
+        }
+        mBlobTracker.globalAssignment = HAND_GLOBAL_ASSIGNMENT;
+        mBlobTracker.kalmanFiltering = HAND_KALMAN_FILTER;
+        mBlobTracker.movementFiltering = HAND_MOVEMENT_FILTERING;
+        mBlobTracker.ghostFrames = HAND_GHOST_FRAMES;
+        mBlobTracker.trackBlobs(mBlobs);
+        _HAND_BLOBS = mBlobTracker.trackedBlobs.size();
+
+        attributeBlobsToItems();
+    }
+
+    // Marks items under an arm and remembers which tracked blob it was, so events can name the shopper.
+    void attributeBlobsToItems()
+    {
+        if (mItemIndexDirty)
+        {
+            vector<Area> rects;
+            rects.reserve(mItems.size());
+            for (const auto& item : mItems) rects.push_back(Area(item.getRect()));
+            mItemIndex.build(rects);
+            mItemIndexDirty = false;
+        }
+
+        for (auto& item : mItems) item.isHandOver = false;
+        for (const auto& blob : mBlobTracker.trackedBlobs)
+        {
+            Area box(blob.box.x - HAND_ROI_MARGIN, blob.box.y - HAND_ROI_MARGIN,
+                blob.box.x + blob.box.width + HAND_ROI_MARGIN, blob.box.y + blob.box.height + HAND_ROI_MARGIN);
+            mItemIndex.query(box, [&](int idx)
+            {
+                mItems[idx].isHandOver = true;
+                mItems[idx].lastBlobId = blob.id;
+            });
         }
     }
 
@@ -591,12 +1022,26 @@ private:
 
     ds::DeviceRef mDevice;
     int mDepthW = 0, mDepthH = 0;
+    double mLastDepthTime = 0;
 
     gl::TextureRef mDepthTexture;
     gl::TextureRef mColorTexture;
     gl::TextureRef mDepthToColorTableTexture;
 
-    Surface mDepthAsColorSurface;
+    FrameArena mFrameArena;
+
+    Channel16u mShelfDepth;
+    BlobFinder::Option mBlobOption;
+    BlobFinder::Workspace mBlobWorkspace;
+    vector<Blob> mBlobs;
+    BlobTracker mBlobTracker;
+    RectIndex mItemIndex;       // over item rects, rebuilt when mItemIndexDirty
+    bool mItemIndexDirty = true;
+
+    EventServer mEventServer;
+    StatusServer mStatusServer;
+    uint32_t mFrameIndex = 0;
+    vector<uint16_t> mOccupancy;
 
     gl::GlslProgRef	mDepthShader, mColorShader;
 };
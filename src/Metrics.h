@@ -0,0 +1,153 @@
+/*
+* Metrics.h
+*
+* Process-wide counters and latency histograms rendered in the Prometheus
+* text exposition format by StatusServer on GET /metrics.
+*
+* Everything on the hot path is a relaxed atomic add, no locks and no
+* allocation. Per-item series come from the status snapshot instead.
+*
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+class MetricCounter
+{
+public:
+    MetricCounter() : mValue(0) {}
+
+    void inc(uint64_t n = 1) { mValue.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return mValue.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> mValue;
+};
+
+// Fixed buckets from 100 us to 5 s, which covers both detection and network latency.
+class MetricHistogram
+{
+public:
+    static const int kBucketCount = 15;
+
+    MetricHistogram() : mSumNs(0), mCount(0)
+    {
+        for (auto& bucket : mBuckets) bucket.store(0);
+    }
+
+    void observe(double seconds)
+    {
+        int i = 0;
+        while (i < kBucketCount && seconds > bounds()[i]) i++;
+        mBuckets[i].fetch_add(1, std::memory_order_relaxed);
+        mSumNs.fetch_add(uint64_t(seconds * 1e9), std::memory_order_relaxed);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void render(std::string& out, const char* name, const char* help) const
+    {
+        char buf[256];
+        sprintf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+        out += buf;
+
+        // Prometheus buckets are cumulative.
+        uint64_t cumulative = 0;
+        for (int i = 0; i < kBucketCount; i++)
+        {
+            cumulative += mBuckets[i].load(std::memory_order_relaxed);
+            sprintf(buf, "%s_bucket{le=\"%g\"} %llu\n", name, bounds()[i], (unsigned long long)cumulative);
+            out += buf;
+        }
+        cumulative += mBuckets[kBucketCount].load(std::memory_order_relaxed);
+        sprintf(buf, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+            name, (unsigned long long)cumulative,
+            name, mSumNs.load(std::memory_order_relaxed) * 1e-9,
+            name, (unsigned long long)mCount.load(std::memory_order_relaxed));
+        out += buf;
+    }
+
+private:
+    static const double* bounds()
+    {
+        static const double kBounds[kBucketCount] =
+        {
+            0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+        };
+        return kBounds;
+    }
+
+    std::atomic<uint64_t> mBuckets[kBucketCount + 1];
+    std::atomic<uint64_t> mSumNs;
+    std::atomic<uint64_t> mCount;
+};
+
+// Observes the lifetime of the scope into a histogram.
+class MetricTimer
+{
+public:
+    explicit MetricTimer(MetricHistogram& histogram)
+        : mHistogram(histogram), mStart(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~MetricTimer()
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - mStart;
+        mHistogram.observe(elapsed.count());
+    }
+
+private:
+    MetricHistogram& mHistogram;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+struct Metrics
+{
+    MetricCounter depthFramesReceived;
+    MetricCounter depthFramesDropped;
+    MetricCounter itemStateFlips;
+    MetricCounter httpNotifyFailures;
+    MetricCounter colorVerifyRejections;
+    MetricCounter handDeferredFrames;
+    MetricCounter statusOversizedRequests;
+    MetricCounter statusTimeouts;
+    MetricCounter eventSubscribersDropped;
+    MetricHistogram detectionSeconds;
+    MetricHistogram httpNotifySeconds;
+    MetricHistogram textureUploadSeconds;
+
+    static Metrics& get()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void render(std::string& out) const
+    {
+        renderCounter(out, "smartmonitor_depth_frames_received_total", "Depth frames delivered by the sensor.", depthFramesReceived);
+        renderCounter(out, "smartmonitor_depth_frames_dropped_total", "Depth frames missed or delivered empty.", depthFramesDropped);
+        renderCounter(out, "smartmonitor_item_state_flips_total", "Pickup/return transitions of all items.", itemStateFlips);
+        renderCounter(out, "smartmonitor_http_notify_failures_total", "Failed pickup/return HTTP notifications.", httpNotifyFailures);
+        renderCounter(out, "smartmonitor_color_verify_rejections_total", "Depth state changes vetoed by the color check.", colorVerifyRejections);
+        renderCounter(out, "smartmonitor_hand_deferred_frames_total", "Item state changes held back while an arm was over the item.", handDeferredFrames);
+        renderCounter(out, "smartmonitor_status_oversized_requests_total", "Status requests rejected for exceeding the header limit.", statusOversizedRequests);
+        renderCounter(out, "smartmonitor_status_timeouts_total", "Status connections closed after staying idle.", statusTimeouts);
+        renderCounter(out, "smartmonitor_event_subscribers_dropped_total", "Event subscribers disconnected for falling too far behind.", eventSubscribersDropped);
+        detectionSeconds.render(out, "smartmonitor_detection_seconds", "Time spent running item detection on a depth frame.");
+        httpNotifySeconds.render(out, "smartmonitor_http_notify_seconds", "Latency of pickup/return HTTP notifications.");
+        textureUploadSeconds.render(out, "smartmonitor_texture_upload_seconds", "Time spent uploading per-frame textures.");
+    }
+
+private:
+    static void renderCounter(std::string& out, const char* name, const char* help, const MetricCounter& counter)
+    {
+        char buf[256];
+        sprintf(buf, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            name, help, name, name, (unsigned long long)counter.get());
+        out += buf;
+    }
+};
@@ -0,0 +1,148 @@
+/*
+* RectIndex.h
+*
+* Static R-tree over a set of rectangles, bulk loaded with Sort-Tile-Recursive
+* packing. Item ROIs only change when they are edited, so the tree is rebuilt
+* then and each per-frame query costs O(log n + hits).
+*
+*/
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cinder/Area.h"
+
+class RectIndex
+{
+public:
+    enum { kFanout = 8 };
+
+    void build(const std::vector<ci::Area>& rects)
+    {
+        mNodes.clear();
+        mOrder.resize(rects.size());
+        for (size_t i = 0; i < rects.size(); i++) mOrder[i] = i;
+        mRoot = -1;
+        if (rects.empty()) return;
+
+        // Leaves group up to kFanout rects, children of every node are contiguous.
+        std::vector<ci::Area> bounds(rects);
+        pack(bounds, mOrder);
+        int levelStart = 0;
+        int levelCount = appendLevel(bounds, mOrder, levelStart, true);
+
+        while (levelCount > 1)
+        {
+            std::vector<ci::Area> nodeBounds(levelCount);
+            std::vector<int> nodeIds(levelCount);
+            for (int i = 0; i < levelCount; i++)
+            {
+                nodeBounds[i] = mNodes[levelStart + i].bounds;
+                nodeIds[i] = levelStart + i;
+            }
+            // Nodes of a level are already tiled, so keep their order to keep children contiguous.
+            levelStart = mNodes.size();
+            levelCount = appendLevel(nodeBounds, nodeIds, levelStart, false);
+        }
+        mRoot = levelStart;
+    }
+
+    // Calls visit(index) for every rect sharing at least one pixel with area.
+    template <typename Visitor>
+    void query(const ci::Area& area, Visitor&& visit) const
+    {
+        if (mRoot < 0) return;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = mRoot;
+        while (top > 0)
+        {
+            const Node& node = mNodes[stack[--top]];
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                if (node.isLeaf)
+                {
+                    if (intersects(mLeafBounds[i], area)) visit(mOrder[i]);
+                }
+                else if (intersects(mNodes[i].bounds, area))
+                {
+                    stack[top++] = i;
+                }
+            }
+        }
+    }
+
+    bool empty() const { return mRoot < 0; }
+
+private:
+    struct Node
+    {
+        ci::Area bounds;
+        int first;      // into mOrder/mLeafBounds for leaves, into mNodes otherwise
+        int count;
+        bool isLeaf;
+    };
+
+    static bool intersects(const ci::Area& a, const ci::Area& b)
+    {
+        return a.x1 < b.x2 && b.x1 < a.x2 && a.y1 < b.y2 && b.y1 < a.y2;
+    }
+
+    // Sorts into vertical slices by center x, then each slice by center y.
+    static void pack(std::vector<ci::Area>& bounds, std::vector<int>& ids)
+    {
+        const int n = bounds.size();
+        std::vector<int> perm(n);
+        for (int i = 0; i < n; i++) perm[i] = i;
+
+        std::sort(perm.begin(), perm.end(), [&](int a, int b)
+        {
+            return bounds[a].x1 + bounds[a].x2 < bounds[b].x1 + bounds[b].x2;
+        });
+        int leafCount = (n + kFanout - 1) / kFanout;
+        int sliceCount = (int)std::ceil(std::sqrt((double)leafCount));
+        int sliceSize = sliceCount * kFanout;
+        for (int s = 0; s < n; s += sliceSize)
+        {
+            std::sort(perm.begin() + s, perm.begin() + std::min(n, s + sliceSize), [&](int a, int b)
+            {
+                return bounds[a].y1 + bounds[a].y2 < bounds[b].y1 + bounds[b].y2;
+            });
+        }
+
+        std::vector<ci::Area> sortedBounds(n);
+        std::vector<int> sortedIds(n);
+        for (int i = 0; i < n; i++)
+        {
+            sortedBounds[i] = bounds[perm[i]];
+            sortedIds[i] = ids[perm[i]];
+        }
+        bounds.swap(sortedBounds);
+        ids.swap(sortedIds);
+    }
+
+    int appendLevel(const std::vector<ci::Area>& bounds, const std::vector<int>& ids, int levelStart, bool isLeaf)
+    {
+        const int n = bounds.size();
+        if (isLeaf) mLeafBounds = bounds;
+        for (int first = 0; first < n; first += kFanout)
+        {
+            Node node;
+            node.first = isLeaf ? first : ids[first];
+            node.count = std::min<int>(kFanout, n - first);
+            node.isLeaf = isLeaf;
+            node.bounds = bounds[first];
+            for (int i = first + 1; i < first + node.count; i++) node.bounds.include(bounds[i]);
+            mNodes.push_back(node);
+        }
+        return mNodes.size() - levelStart;
+    }
+
+    std::vector<Node> mNodes;
+    std::vector<ci::Area> mLeafBounds;
+    std::vector<int> mOrder;    // item index of every leaf entry
+    int mRoot = -1;
+};
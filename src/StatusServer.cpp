@@ -0,0 +1,351 @@
+#include "StatusServer.h"
+#include "Metrics.h"
+
+#include "cinder/Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <istream>
+
+using std::string;
+using asio::ip::tcp;
+
+// The server listens on every interface, so a peer must not be able to grow a request
+// or hold a connection open forever.
+static const size_t kMaxRequestBytes = 8192;
+static const std::chrono::seconds kIdleTimeout(30);
+
+static void appendJsonString(string& out, const string& str)
+{
+    out += '"';
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                sprintf(buf, "\\u%04x", c);
+                out += buf;
+            }
+            else out += c;
+        }
+    }
+    out += '"';
+}
+
+static const char* statusText(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 431: return "Request Header Fields Too Large";
+    default: return "Bad Request";
+    }
+}
+
+class StatusServer::Connection : public std::enable_shared_from_this<StatusServer::Connection>
+{
+public:
+    Connection(StatusServer* server, tcp::socket socket)
+        : mServer(server), mSocket(std::move(socket)), mRequest(kMaxRequestBytes), mDeadline(server->mIo)
+    {
+        asio::error_code ec;
+        mSocket.set_option(tcp::no_delay(true), ec);
+    }
+
+    void start()
+    {
+        doRead();
+    }
+
+    void close()
+    {
+        asio::error_code ec;
+        mDeadline.cancel(ec);
+        mSocket.close(ec);
+    }
+
+private:
+    // Closes the connection unless the next request is read and answered within kIdleTimeout.
+    void resetDeadline()
+    {
+        auto self = shared_from_this();
+        mDeadline.expires_from_now(kIdleTimeout);
+        mDeadline.async_wait([this, self](asio::error_code ec)
+        {
+            if (ec == asio::error::operation_aborted) return;
+            Metrics::get().statusTimeouts.inc();
+            mServer->removeConnection(this);
+        });
+    }
+
+    void doRead()
+    {
+        resetDeadline();
+
+        auto self = shared_from_this();
+        asio::async_read_until(mSocket, mRequest, "\r\n\r\n", [this, self](asio::error_code ec, size_t)
+        {
+            if (ec == asio::error::not_found)
+            {
+                // mRequest filled up before the end of the headers.
+                Metrics::get().statusOversizedRequests.inc();
+                reply(431, "{\"error\":\"request too large\"}", "application/json", false);
+                return;
+            }
+            if (ec)
+            {
+                mServer->removeConnection(this);
+                return;
+            }
+
+            std::istream stream(&mRequest);
+            string method, path, version, line;
+            stream >> method >> path >> version;
+            std::getline(stream, line);
+
+            bool keepAlive = (version == "HTTP/1.1");
+            while (std::getline(stream, line) && line != "\r")
+            {
+                std::transform(line.begin(), line.end(), line.begin(), ::tolower);
+                if (line.find("connection:") != 0) continue;
+                if (line.find("close") != string::npos) keepAlive = false;
+                else if (line.find("keep-alive") != string::npos) keepAlive = true;
+            }
+
+            int status = 200;
+            const char* contentType = "application/json";
+            string body = mServer->handleRequest(method, path, &status, &contentType);
+            reply(status, body, contentType, keepAlive);
+        });
+    }
+
+    void reply(int status, const string& body, const char* contentType, bool keepAlive)
+    {
+        char header[256];
+        sprintf(header, "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %d\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Connection: %s\r\n\r\n",
+            status, statusText(status), contentType, (int)body.size(), keepAlive ? "keep-alive" : "close");
+        mResponse = header;
+        mResponse += body;
+        doWrite(keepAlive);
+    }
+
+    void doWrite(bool keepAlive)
+    {
+        auto self = shared_from_this();
+        asio::async_write(mSocket, asio::buffer(mResponse), [this, self, keepAlive](asio::error_code ec, size_t)
+        {
+            if (ec || !keepAlive) mServer->removeConnection(this);
+            else doRead();
+        });
+    }
+
+    StatusServer* mServer;
+    tcp::socket mSocket;
+    asio::streambuf mRequest;   // at most kMaxRequestBytes
+    asio::steady_timer mDeadline;
+    string mResponse;
+};
+
+StatusServer::StatusServer()
+    : mAcceptor(mIo), mPendingSocket(mIo), mAcceptRetry(mIo)
+{
+}
+
+StatusServer::~StatusServer()
+{
+    stop();
+}
+
+bool StatusServer::start(int port)
+{
+    stop();
+
+    asio::error_code ec;
+    tcp::endpoint endpoint(tcp::v4(), port);
+    mAcceptor.open(endpoint.protocol(), ec);
+    if (!ec) mAcceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+    if (!ec) mAcceptor.bind(endpoint, ec);
+    if (!ec) mAcceptor.listen(asio::socket_base::max_connections, ec);
+    if (ec)
+    {
+        mAcceptor.close(ec);
+        return false;
+    }
+
+    mIo.reset();
+    mWork.reset(new asio::io_service::work(mIo));
+    doAccept();
+    mThread = std::thread([this] { mIo.run(); });
+    return true;
+}
+
+void StatusServer::stop()
+{
+    if (!mThread.joinable()) return;
+
+    mIo.post([this]
+    {
+        asio::error_code ec;
+        mAcceptor.close(ec);
+        mAcceptRetry.cancel(ec);
+        for (auto& connection : mConnections) connection->close();
+        mConnections.clear();
+    });
+    mWork.reset();
+    mThread.join();
+}
+
+void StatusServer::doAccept()
+{
+    mAcceptor.async_accept(mPendingSocket, [this](asio::error_code ec)
+    {
+        if (ec)
+        {
+            // Aborted by stop(), otherwise e.g. out of file descriptors: keep listening after a short pause.
+            if (ec == asio::error::operation_aborted || !mAcceptor.is_open()) return;
+            CI_LOG_W("Status server accept failed: " << ec.message());
+            mAcceptRetry.expires_from_now(std::chrono::milliseconds(100));
+            mAcceptRetry.async_wait([this](asio::error_code ec)
+            {
+                if (!ec && mAcceptor.is_open()) doAccept();
+            });
+            return;
+        }
+
+        auto connection = std::make_shared<Connection>(this, std::move(mPendingSocket));
+        mConnections.push_back(connection);
+        connection->start();
+
+        mPendingSocket = tcp::socket(mIo);
+        doAccept();
+    });
+}
+
+void StatusServer::removeConnection(Connection* connection)
+{
+    auto it = std::find_if(mConnections.begin(), mConnections.end(),
+        [connection](const ConnectionRef& c) { return c.get() == connection; });
+    if (it == mConnections.end()) return;
+
+    (*it)->close();
+    mConnections.erase(it);
+}
+
+string StatusServer::handleRequest(const string& method, const string& path,
+    int* status, const char** contentType)
+{
+    if (method != "GET")
+    {
+        *status = 405;
+        return "{\"error\":\"only GET is supported\"}";
+    }
+
+    // Ignore any query string.
+    string route = path.substr(0, path.find('?'));
+    if (route == "/api/items") return renderItems(mSnapshots.getFront());
+    if (route == "/api/status") return renderStatus(mSnapshots.getFront());
+    if (route == "/metrics")
+    {
+        *contentType = "text/plain; version=0.0.4";
+        return renderMetrics(mSnapshots.getFront());
+    }
+
+    *status = 404;
+    return "{\"error\":\"not found\"}";
+}
+
+string StatusServer::renderItems(const Snapshot& snapshot) const
+{
+    string out;
+    out.reserve(128 + snapshot.items.size() * 160);
+    char buf[256];
+
+    sprintf(buf, "{\"frame\":%u,\"count\":%d,\"items\":[", snapshot.frameIndex, (int)snapshot.items.size());
+    out += buf;
+    for (size_t i = 0; i < snapshot.items.size(); i++)
+    {
+        const auto& item = snapshot.items[i];
+        if (i > 0) out += ',';
+        sprintf(buf, "{\"index\":%d,\"name\":", (int)i);
+        out += buf;
+        appendJsonString(out, item.name);
+        sprintf(buf, ",\"roi\":{\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d}"
+            ",\"state\":\"%s\",\"usedCount\":%d,\"occupancy\":%.3f,\"blob\":%d}",
+            item.x, item.y, item.width, item.height,
+            item.isUsing ? "pickup" : "return", item.usedCount, item.occupancy, item.lastBlobId);
+        out += buf;
+    }
+    out += "]}";
+    return out;
+}
+
+string StatusServer::renderStatus(const Snapshot& snapshot) const
+{
+    int usingCount = 0;
+    for (const auto& item : snapshot.items)
+    {
+        if (item.isUsing) usingCount++;
+    }
+
+    char buf[256];
+    sprintf(buf, "{\"fps\":%.1f,\"frame\":%u,\"items\":%d,\"itemsInUse\":%d,\"subscribers\":%d,\"arenaMisses\":%d}",
+        snapshot.fps, snapshot.frameIndex, (int)snapshot.items.size(), usingCount,
+        snapshot.subscribers, snapshot.arenaMisses);
+    return buf;
+}
+
+string StatusServer::renderMetrics(const Snapshot& snapshot) const
+{
+    string out;
+    out.reserve(4096 + snapshot.items.size() * 256);
+    Metrics::get().render(out);
+
+    int usingCount = 0;
+    for (const auto& item : snapshot.items)
+    {
+        if (item.isUsing) usingCount++;
+    }
+
+    char buf[1024];
+    sprintf(buf, "# HELP smartmonitor_fps Average app frame rate.\n# TYPE smartmonitor_fps gauge\nsmartmonitor_fps %.2f\n"
+        "# HELP smartmonitor_items Monitored items.\n# TYPE smartmonitor_items gauge\nsmartmonitor_items %d\n"
+        "# HELP smartmonitor_items_in_use Items currently picked up.\n# TYPE smartmonitor_items_in_use gauge\nsmartmonitor_items_in_use %d\n"
+        "# HELP smartmonitor_event_subscribers Connected event stream subscribers.\n# TYPE smartmonitor_event_subscribers gauge\nsmartmonitor_event_subscribers %d\n",
+        snapshot.fps, (int)snapshot.items.size(), usingCount, snapshot.subscribers);
+    out += buf;
+
+    out += "# HELP smartmonitor_item_flips_total Pickup/return transitions per item.\n"
+        "# TYPE smartmonitor_item_flips_total counter\n";
+    for (const auto& item : snapshot.items)
+    {
+        // Label values only need quotes, backslashes and newlines escaped.
+        out += "smartmonitor_item_flips_total{item=\"";
+        for (char c : item.name)
+        {
+            if (c == '\n') out += "\\n";
+            else
+            {
+                if (c == '"' || c == '\\') out += '\\';
+                out += c;
+            }
+        }
+        sprintf(buf, "\"} %d\n", item.stateFlips);
+        out += buf;
+    }
+    return out;
+}
@@ -0,0 +1,123 @@
+/*
+* StatusServer.h
+*
+* Small embedded HTTP server answering "what is the state of every item
+* right now" without touching the frame loop.
+*
+*   GET /api/items    every item: index, name, roi, state, used count, occupancy, last blob
+*   GET /api/status   live metrics: fps, frame index, subscribers, arena misses
+*   GET /metrics      Prometheus text format, see Metrics.h
+*
+* Request headers are capped at 8 KB (431 beyond that) and a connection that
+* doesn't complete a request within 30 s is closed.
+* tools/StatusLoadTest.cpp hammers these endpoints from a local client.
+*
+* The frame loop fills a Snapshot and hands it over through a lock-free
+* triple buffer; the server thread only ever reads the latest complete one.
+*
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include "asio/asio.hpp"
+
+// Single producer / single consumer triple buffer. The producer never waits
+// for the consumer and the consumer always sees the newest published value.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : mMiddle(1), mBack(2), mFront(0) {}
+
+    // Producer side: fill getBack(), then publish().
+    T& getBack() { return mSlots[mBack]; }
+    void publish()
+    {
+        mBack = mMiddle.exchange(mBack | kDirty) & kIndexMask;
+    }
+
+    // Consumer side: returns the newest published value.
+    const T& getFront()
+    {
+        if (mMiddle.load() & kDirty)
+        {
+            mFront = mMiddle.exchange(mFront) & kIndexMask;
+        }
+        return mSlots[mFront];
+    }
+
+private:
+    static const int kDirty = 4;
+    static const int kIndexMask = 3;
+
+    T mSlots[3];
+    std::atomic<int> mMiddle;
+    int mBack;  // producer only
+    int mFront; // consumer only
+};
+
+class StatusServer
+{
+public:
+    struct ItemState
+    {
+        std::string name;
+        int x = 0, y = 0, width = 0, height = 0;
+        bool isUsing = false;
+        int usedCount = 0;
+        int stateFlips = 0;
+        int lastBlobId = -1;
+        float occupancy = 0;
+    };
+
+    struct Snapshot
+    {
+        std::vector<ItemState> items;
+        float fps = 0;
+        uint32_t frameIndex = 0;
+        int subscribers = 0;
+        int arenaMisses = 0;    // see AllocStats in FrameArena.h
+    };
+
+    StatusServer();
+    ~StatusServer();
+
+    // Listens on 0.0.0.0:port so dashboards on the LAN can poll, returns false if the port can't be bound.
+    bool start(int port);
+    void stop();
+
+    // Frame loop side, fill the returned snapshot and then call publishSnapshot().
+    Snapshot& beginSnapshot() { return mSnapshots.getBack(); }
+    void publishSnapshot() { mSnapshots.publish(); }
+
+private:
+    class Connection;
+    typedef std::shared_ptr<Connection> ConnectionRef;
+
+    void doAccept();
+    void removeConnection(Connection* connection);
+    std::string handleRequest(const std::string& method, const std::string& path,
+        int* status, const char** contentType);
+    std::string renderItems(const Snapshot& snapshot) const;
+    std::string renderStatus(const Snapshot& snapshot) const;
+    std::string renderMetrics(const Snapshot& snapshot) const;
+
+    asio::io_service mIo;
+    std::unique_ptr<asio::io_service::work> mWork;
+    asio::ip::tcp::acceptor mAcceptor;
+    asio::ip::tcp::socket mPendingSocket;
+    asio::steady_timer mAcceptRetry;
+    std::thread mThread;
+    std::vector<ConnectionRef> mConnections; // io thread only
+
+    TripleBuffer<Snapshot> mSnapshots;
+};
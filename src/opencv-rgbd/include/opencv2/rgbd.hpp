@@ -112,6 +112,15 @@ namespace rgbd
       RGBD_NORMALS_METHOD_FALS, RGBD_NORMALS_METHOD_LINEMOD, RGBD_NORMALS_METHOD_SRI
     };
 
+    /** The normals are either rows x cols x 3 matrices of the depth of the object (RGBD_NORMALS_FORMAT_VEC3), or
+     * CV_16SC2 matrices of octahedral encoded normals, 3 to 6 times smaller (RGBD_NORMALS_FORMAT_OCTAHEDRAL), see
+     * packNormal and unpackNormal
+     */
+    enum RGBD_NORMALS_FORMAT
+    {
+      RGBD_NORMALS_FORMAT_VEC3, RGBD_NORMALS_FORMAT_OCTAHEDRAL
+    };
+
     RgbdNormals()
         :
           rows_(0),
@@ -120,6 +129,7 @@ namespace rgbd
           K_(Mat()),
           window_size_(0),
           method_(RGBD_NORMALS_METHOD_FALS),
+          format_(RGBD_NORMALS_FORMAT_VEC3),
           rgbd_normals_impl_(0)
     {
     }
@@ -139,10 +149,21 @@ namespace rgbd
 
     /** Given a set of 3d points in a depth image, compute the normals at each point.
      * @param points a rows x cols x 3 matrix of CV_32F/CV64F or a rows x cols x 1 CV_U16S
-     * @param normals a rows x cols x 3 matrix
+     * @param normals a rows x cols x 3 matrix, or rows x cols x 2 CV_16S with RGBD_NORMALS_FORMAT_OCTAHEDRAL
+     * @param mask an optional CV_8UC1 mask of the pixels to compute normals at, the others are NaN. Only its bounding
+     *        box, plus the margin the method needs around it, is processed
+     */
+    void
+    operator()(InputArray points, OutputArray normals, InputArray mask = noArray()) const;
+
+    /** Same as above but only computing the normals inside some rectangles, the others are NaN. The cost is
+     * proportional to the area of the rectangles, overlapping ones are computed twice.
+     * @param points a rows x cols x 3 matrix of CV_32F/CV64F or a rows x cols x 1 CV_U16S
+     * @param normals a rows x cols x 3 matrix, or rows x cols x 2 CV_16S with RGBD_NORMALS_FORMAT_OCTAHEDRAL
+     * @param rois the rectangles to compute normals in
      */
     void
-    operator()(InputArray points, OutputArray normals) const;
+    operator()(InputArray points, OutputArray normals, const std::vector<Rect>& rois) const;
 
     /** Initializes some data that is cached for later computation
      * If that function is not called, it will be called the first time normals are computed
@@ -198,18 +219,80 @@ namespace rgbd
     {
         method_ = val;
     }
+    int getFormat() const
+    {
+        return format_;
+    }
+    void setFormat(int val)
+    {
+        format_ = val;
+    }
 
   protected:
     void
     initialize_normals_impl(int rows, int cols, int depth, const Mat & K, int window_size, int method) const;
 
+    void
+    compute_normals_impl(InputArray points, OutputArray normals, const Mat& mask, const std::vector<Rect>& rois) const;
+
     int rows_, cols_, depth_;
     Mat K_;
     int window_size_;
     int method_;
+    int format_;
     mutable void* rgbd_normals_impl_;
   };
 
+  /** Octahedral encoding of a normal in two signed 16 bit values, the format of RgbdNormals with
+   * RGBD_NORMALS_FORMAT_OCTAHEDRAL. The normal is projected on the octahedron |x| + |y| + |z| = 1 and the lower half
+   * is folded over the upper one, the angular error is about 1e-4. NaN, zero and infinite normals have no direction
+   * and are stored as SHRT_MIN.
+   */
+  inline Vec2s
+  packNormal(float x, float y, float z)
+  {
+    float l1 = std::abs(x) + std::abs(y) + std::abs(z);
+    // Also false for NaN
+    if (!(l1 > 0) || cvIsInf(l1))
+      return Vec2s(SHRT_MIN, SHRT_MIN);
+    float inv_l1 = 1.f / l1;
+    float u = x * inv_l1, v = y * inv_l1;
+    if (z < 0)
+    {
+      float folded_u = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+      v = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+      u = folded_u;
+    }
+    return Vec2s((short)cvRound(u * SHRT_MAX), (short)cvRound(v * SHRT_MAX));
+  }
+
+  /** Decodes a normal encoded by packNormal, as a unit vector
+   */
+  inline Vec3f
+  unpackNormal(const Vec2s& packed)
+  {
+    if (packed[0] == SHRT_MIN)
+      return Vec3f::all(std::numeric_limits<float>::quiet_NaN());
+    float u = packed[0] * (1.f / SHRT_MAX), v = packed[1] * (1.f / SHRT_MAX);
+    float z = 1 - std::abs(u) - std::abs(v);
+    if (z < 0)
+    {
+      float unfolded_u = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+      v = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+      u = unfolded_u;
+    }
+    float inv_norm = 1.f / std::sqrt(u * u + v * v + z * z);
+    return Vec3f(u * inv_norm, v * inv_norm, z * inv_norm);
+  }
+
+  /** Decodes a CV_16SC2 matrix of normals encoded by packNormal
+   * @param packed the encoded normals
+   * @param normals a CV_32FC3 matrix of the same size
+   */
+  CV_EXPORTS
+  void
+  unpackNormals(InputArray packed, OutputArray normals);
+
   /** Object that can clean a noisy depth image
    */
   class CV_EXPORTS DepthCleaner: public Algorithm
@@ -218,10 +301,12 @@ namespace rgbd
     /** NIL method is from
      * ``Modeling Kinect Sensor Noise for Improved 3d Reconstruction and Tracking``
      * by C. Nguyen, S. Izadi, D. Lovel
+     * TEMPORAL is a per pixel recursive average over about window_size frames of a CV_16U stream, restarted where
+     * the scene moves and holding invalid pixels for up to window_size frames. Every call adds a frame.
      */
     enum DEPTH_CLEANER_METHOD
     {
-      DEPTH_CLEANER_NIL
+      DEPTH_CLEANER_NIL, DEPTH_CLEANER_TEMPORAL
     };
 
     DepthCleaner()
@@ -229,6 +314,7 @@ namespace rgbd
           depth_(0),
           window_size_(0),
           method_(DEPTH_CLEANER_NIL),
+          num_stripes_(0),
           depth_cleaner_impl_(0)
     {
     }
@@ -244,7 +330,7 @@ namespace rgbd
 
     /** Given a set of 3d points in a depth image, compute the normals at each point.
      * @param points a rows x cols x 3 matrix of CV_32F/CV64F or a rows x cols x 1 CV_U16S
-     * @param depth a rows x cols matrix of the cleaned up depth
+     * @param depth a rows x cols matrix of the cleaned up depth, it can be points itself to clean in place
      */
     void
     operator()(InputArray points, OutputArray depth) const;
@@ -279,6 +365,18 @@ namespace rgbd
     {
         method_ = val;
     }
+    /** Number of stripes the bands of rows of an image are split into for cv::parallel_for_: 1 cleans in the calling
+     * thread, 0 lets cv::parallel_for_ decide. A stripe runs on one thread, so N stripes keep at most N threads busy,
+     * but the thread pool itself is not resized. The result is the same whatever the number of stripes.
+     */
+    int getNumStripes() const
+    {
+        return num_stripes_;
+    }
+    void setNumStripes(int val)
+    {
+        num_stripes_ = val;
+    }
 
   protected:
     void
@@ -287,6 +385,7 @@ namespace rgbd
     int depth_;
     int window_size_;
     int method_;
+    int num_stripes_;
     mutable void* depth_cleaner_impl_;
   };
 
@@ -298,7 +397,10 @@ namespace rgbd
    *
    * uv_rgb = K_rgb * [R | t] * z * inv(K_ir) * uv_ir
    *
-   * Currently does not check for negative depth values.
+   * Points that end up behind the external camera are skipped, except with more than 8 distortion coefficients.
+   * Up to 8 distortion coefficients, the precomputed registration of the last calibration is reused across calls,
+   * which are serialized. To register streams of several calibrations or from several threads, keep a
+   * DepthRegistration object per stream instead.
    *
    * @param unregisteredCameraMatrix the camera matrix of the depth camera
    * @param registeredCameraMatrix the camera matrix of the external camera
@@ -315,10 +417,96 @@ namespace rgbd
                 InputArray Rt, InputArray unregisteredDepth, const Size& outputImagePlaneSize,
                 OutputArray registeredDepth, bool depthDilation=false);
 
+  /** Object registering depth images to an external camera like registerDepth, for a fixed calibration.
+   * The projection of every depth pixel is cached as an affine function of its depth, so that registering a frame
+   * is a multiply-add per coordinate, the distortion of the external camera if any, and a z-buffer test. Frames are
+   * registered in parallel, the z-buffer is shared through atomic minimums.
+   */
+  class CV_EXPORTS DepthRegistration: public Algorithm
+  {
+  public:
+    /** Default constructor, an identity calibration without an external image: only meant to be assigned to, the
+     * operator() and computeLookupTables() need the other constructor
+     */
+    DepthRegistration()
+        :
+          unregisteredCameraMatrix_(Matx33f::eye()),
+          registeredCameraMatrix_(Matx33f::eye()),
+          hasDistortion_(false),
+          rbtRgb2Depth_(Matx44f::eye()),
+          outputImagePlaneSize_(0, 0)
+    {
+      std::fill(distCoeffs_, distCoeffs_ + 8, 0.f);
+    }
+
+    /** Constructor
+     * @param unregisteredCameraMatrix the camera matrix of the depth camera
+     * @param registeredCameraMatrix the camera matrix of the external camera
+     * @param registeredDistCoeffs the distortion coefficients of the external camera, at most 8
+     * @param Rt the rigid body transform between the cameras
+     * @param outputImagePlaneSize the image plane dimensions of the external camera (width, height)
+     */
+    DepthRegistration(InputArray unregisteredCameraMatrix, InputArray registeredCameraMatrix,
+                      InputArray registeredDistCoeffs, InputArray Rt, const Size& outputImagePlaneSize);
+
+    /** Registers a depth image
+     * Depths are projected and compared in float, CV_64F depth comes out rounded to float precision.
+     * @param unregisteredDepth the input depth data
+     * @param registeredDepth the result of transforming the depth into the external camera
+     * @param depthDilation whether or not the depth is dilated to avoid holes and occlusion errors (optional)
+     */
+    void
+    operator()(InputArray unregisteredDepth, OutputArray registeredDepth, bool depthDilation = false) const;
+
+    /** Builds the lookup tables between the depth image and the external image for the scene seen in a depth image,
+     * e.g. the empty background. Both tables are CV_32FC2 pixel locations in the other image, infinite where there is
+     * no match, and are kept until the next call.
+     * Locations are in pixels with integers at pixel centers, like the input of remap. This is not the convention of
+     * sensor SDK depth-to-color tables, which are normalized to [0,1) with 0 at the left or top edge: the normalized
+     * location of (x, y) in a width x height image is ((x + 0.5) / width, (y + 0.5) / height).
+     * @param unregisteredDepth the depth the tables are computed for
+     */
+    void
+    computeLookupTables(InputArray unregisteredDepth);
+
+    /** For every depth pixel, the location its center projects to in the external image
+     */
+    Mat getDepthToRegisteredTable() const
+    {
+        return depthToRegistered_;
+    }
+    /** For every pixel of the external image, the depth pixel closest to the camera covering it
+     */
+    Mat getRegisteredToDepthTable() const
+    {
+        return registeredToDepth_;
+    }
+
+  protected:
+    void
+    initialize(const Size& unregisteredDepthSize) const;
+
+    Matx33f unregisteredCameraMatrix_;
+    Matx33f registeredCameraMatrix_;
+    float distCoeffs_[8];
+    bool hasDistortion_;
+    Matx44f rbtRgb2Depth_;
+    Size outputImagePlaneSize_;
+
+    mutable Size unregisteredDepthSize_;
+    mutable Mat_<Vec3f> rays_;
+    mutable Vec3f rayDx_, rayDy_;
+    mutable Vec3f translation_;
+    mutable Mat zBuffer_;
+
+    Mat depthToRegistered_;
+    Mat registeredToDepth_;
+  };
+
   /**
-   * @param depth the depth image
+   * @param depth the depth image, CV_16U or CV_16S in millimeters or CV_32F in meters
    * @param in_K
-   * @param in_points the list of xy coordinates
+   * @param in_points the list of xy coordinates, pixels out of the depth image give NaN points
    * @param points3d the resulting 3d points
    */
   CV_EXPORTS
@@ -338,6 +526,60 @@ namespace rgbd
   void
   depthTo3d(InputArray depth, InputArray K, OutputArray points3d, InputArray mask = noArray());
 
+  /** Object converting depth images to 3d points like depthTo3d without a mask, for a fixed calibration matrix.
+   * The rays of the columns and rows are cached for the image size, so a frame is converted in a single pass
+   * straight from CV_16U millimeters (0 giving NaN points) or CV_32F meters to CV_32F points in meters.
+   */
+  class CV_EXPORTS DepthTo3dTable: public Algorithm
+  {
+  public:
+    DepthTo3dTable()
+        :
+          rows_(0),
+          cols_(0)
+    {
+    }
+
+    /** Constructor
+     * @param K the calibration matrix
+     */
+    DepthTo3dTable(InputArray K);
+
+    /** Converts a depth image to an organized set of 3d points
+     * @param depth a CV_16U or CV_32F depth image
+     * @param points3d a rows x cols CV_32FC3 matrix of 3d points
+     */
+    void
+    operator()(InputArray depth, OutputArray points3d) const;
+
+    /** Converts a depth image to separate planes of coordinates
+     * @param depth a CV_16U or CV_32F depth image
+     * @param x the rows x cols CV_32F x coordinates of the points
+     * @param y the y coordinates
+     * @param z the z coordinates
+     */
+    void
+    operator()(InputArray depth, OutputArray x, OutputArray y, OutputArray z) const;
+
+    cv::Mat getK() const
+    {
+        return K_;
+    }
+    void setK(const cv::Mat &val)
+    {
+        K_ = val;
+        rows_ = cols_ = 0;
+    }
+
+  protected:
+    void
+    initialize(int rows, int cols) const;
+
+    Mat K_;
+    mutable int rows_, cols_;
+    mutable Mat_<float> x_rays_, y_rays_;
+  };
+
   /** If the input image is of type CV_16UC1 (like the Kinect one), the image is converted to floats, divided
    * by 1000 to get a depth in meters, and the values 0 are converted to std::numeric_limits<float>::quiet_NaN()
    * Otherwise, the image is simply converted to floats
@@ -374,7 +616,7 @@ namespace rgbd
 
     /** Find The planes in a depth image
      * @param points3d the 3d points organized like the depth image: rows x cols with 3 channels
-     * @param normals the normals for every point in the depth image
+     * @param normals the normals for every point in the depth image, CV_32FC3/CV_64FC3 or CV_16SC2 packed by packNormal
      * @param mask An image where each pixel is labeled with the plane it belongs to
      *        and 255 if it does not belong to any plane
      * @param plane_coefficients the coefficients of the corresponding planes (a,b,c,d) such that ax+by+cz+d=0, norm(a,b,c)=1
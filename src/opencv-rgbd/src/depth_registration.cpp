@@ -44,6 +44,9 @@
 
 #include "precomp.hpp"
 
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace cv
 {
@@ -185,7 +188,7 @@ namespace rgbd
         // Apply the initial projection to the input depth
         Mat_<Point3f> transformedCloud;
         {
-            Mat_<Point3f> point_tmp(outputImagePlaneSize);
+            Mat_<Point3f> point_tmp(unregisteredDepth.size());
 
             for(int j = 0; j < point_tmp.rows; ++j)
             {
@@ -312,6 +315,407 @@ namespace rgbd
 
     }
 
+///////////////////////////////////////////////////////////////////////////////////
+
+    // Depth in meters, 0 meaning no depth like NaN as in performRegistration
+    template<typename DepthDepth>
+    inline float
+    depthInMeters(const DepthDepth &value, const float inputDepthToMetersScale)
+    {
+        float rescaledDepth = float(value) * inputDepthToMetersScale;
+        return (rescaledDepth == 0) ? std::numeric_limits<float>::quiet_NaN() : rescaledDepth;
+    }
+
+    // Lowers *value to newValue if it is smaller, from any thread. Depths are compared through their float bits,
+    // which sort like unsigned integers for positive floats, and 0xffffffff means no depth.
+    static inline void
+    atomicMin(unsigned int *value, unsigned int newValue)
+    {
+        unsigned int oldValue = *(volatile unsigned int*)value;
+        while (newValue < oldValue)
+        {
+#if defined _MSC_VER
+            unsigned int seenValue = (unsigned int)_InterlockedCompareExchange((volatile long*)value, (long)newValue,
+                                                                               (long)oldValue);
+#else
+            unsigned int seenValue = __sync_val_compare_and_swap(value, oldValue, newValue);
+#endif
+            if (seenValue == oldValue)
+                break;
+            oldValue = seenValue;
+        }
+    }
+
+    static inline void
+    atomicMin(uint64 *value, uint64 newValue)
+    {
+        uint64 oldValue = *(volatile uint64*)value;
+        while (newValue < oldValue)
+        {
+#if defined _MSC_VER
+            uint64 seenValue = (uint64)_InterlockedCompareExchange64((volatile __int64*)value, (__int64)newValue,
+                                                                     (__int64)oldValue);
+#else
+            uint64 seenValue = __sync_val_compare_and_swap(value, oldValue, newValue);
+#endif
+            if (seenValue == oldValue)
+                break;
+            oldValue = seenValue;
+        }
+    }
+
+    // Same model as projectPoints with up to 8 coefficients, from normalized to pixel coordinates
+    static inline void
+    distortPoint(const float *k, const Matx33f &cameraMatrix, float &u, float &v)
+    {
+        float x = u, y = v;
+        float r2 = x * x + y * y, r4 = r2 * r2, r6 = r4 * r2;
+        float radial = (1 + k[0] * r2 + k[1] * r4 + k[4] * r6) / (1 + k[5] * r2 + k[6] * r4 + k[7] * r6);
+        float xd = x * radial + 2 * k[2] * x * y + k[3] * (r2 + 2 * x * x);
+        float yd = y * radial + k[2] * (r2 + 2 * y * y) + 2 * k[3] * x * y;
+        u = cameraMatrix(0, 0) * xd + cameraMatrix(0, 2);
+        v = cameraMatrix(1, 1) * yd + cameraMatrix(1, 2);
+    }
+
+    static inline unsigned int
+    floatBits(float value)
+    {
+        unsigned int bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    static inline float
+    bitsToFloat(unsigned int bits)
+    {
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+///////////////////////////////////////////////////////////////////////////////////
+
+    /** Projects rows of the unregistered depth into the z-buffer of DepthRegistration.
+     */
+    template<typename DepthDepth>
+    class RegistrationBody : public ParallelLoopBody
+    {
+    public:
+        RegistrationBody(const Mat_<DepthDepth> &unregisteredDepth, const Mat_<Vec3f> &rays, const Vec3f &translation,
+                         const Matx33f &registeredCameraMatrix, const float *distCoeffs, bool hasDistortion,
+                         bool depthDilation, float inputDepthToMetersScale, Mat &zBuffer)
+            : unregisteredDepth_(unregisteredDepth), rays_(rays), translation_(translation),
+              registeredCameraMatrix_(registeredCameraMatrix), distCoeffs_(distCoeffs), hasDistortion_(hasDistortion),
+              depthDilation_(depthDilation), inputDepthToMetersScale_(inputDepthToMetersScale), zBuffer_(zBuffer)
+        {
+        }
+
+        virtual void
+        operator()(const Range &range) const
+        {
+            const int cols = unregisteredDepth_.cols;
+            AutoBuffer<float> buffer(3 * cols);
+            float *u = buffer, *v = u + cols, *outputDepth = v + cols;
+            const float metersToInputUnitsScale = 1 / inputDepthToMetersScale_;
+
+            for (int j = range.start; j < range.end; ++j)
+            {
+                const DepthDepth *depth = unregisteredDepth_[j];
+                const Vec3f *ray = rays_[j];
+
+                // Straight line code over the row so that it vectorizes, invalid depths simply propagate NaN
+                for (int i = 0; i < cols; ++i)
+                {
+                    float z = depthInMeters<DepthDepth>(depth[i], inputDepthToMetersScale_);
+                    float x = z * ray[i][0] + translation_[0];
+                    float y = z * ray[i][1] + translation_[1];
+                    float w = z * ray[i][2] + translation_[2];
+                    u[i] = x / w;
+                    v[i] = y / w;
+                    outputDepth[i] = w * metersToInputUnitsScale;
+                }
+
+                if (hasDistortion_)
+                {
+                    for (int i = 0; i < cols; ++i)
+                        distortPoint(distCoeffs_, registeredCameraMatrix_, u[i], v[i]);
+                }
+
+                for (int i = 0; i < cols; ++i)
+                {
+                    // Skip this one if there isn't a valid depth in front of the camera
+                    if (!(outputDepth[i] > 0))
+                        continue;
+
+                    const int x = cvRound(u[i]), y = cvRound(v[i]);
+                    if (x < 0 || y < 0 || x >= zBuffer_.cols || y >= zBuffer_.rows)
+                        continue;
+
+                    const unsigned int cloudDepth = floatBits(outputDepth[i]);
+                    atomicMin(zBuffer_.ptr<unsigned int>(y) + x, cloudDepth);
+
+                    // Same 2x2 dilation as performRegistration, towards the top left
+                    if (depthDilation_)
+                    {
+                        if (x > 0)
+                            atomicMin(zBuffer_.ptr<unsigned int>(y) + x - 1, cloudDepth);
+                        if (y > 0)
+                            atomicMin(zBuffer_.ptr<unsigned int>(y - 1) + x, cloudDepth);
+                        if (x > 0 && y > 0)
+                            atomicMin(zBuffer_.ptr<unsigned int>(y - 1) + x - 1, cloudDepth);
+                    }
+                }
+            }
+        }
+
+    private:
+        const Mat_<DepthDepth> &unregisteredDepth_;
+        const Mat_<Vec3f> &rays_;
+        Vec3f translation_;
+        Matx33f registeredCameraMatrix_;
+        const float *distCoeffs_;
+        bool hasDistortion_;
+        bool depthDilation_;
+        float inputDepthToMetersScale_;
+        Mat &zBuffer_;
+    };
+
+    /** Fills the lookup tables of DepthRegistration for rows of the depth image: the projection of every depth pixel
+     * center, and the footprint of every depth pixel in a z-buffer of (depth bits << 32 | depth pixel index) so that
+     * the closest depth pixel wins every external pixel.
+     */
+    template<typename DepthDepth>
+    class LookupTablesBody : public ParallelLoopBody
+    {
+    public:
+        LookupTablesBody(const Mat_<DepthDepth> &unregisteredDepth, const Mat_<Vec3f> &rays, const Vec3f &rayDx,
+                         const Vec3f &rayDy, const Vec3f &translation, const Matx33f &registeredCameraMatrix,
+                         const float *distCoeffs, bool hasDistortion, float inputDepthToMetersScale,
+                         Mat &depthToRegistered, Mat &zBuffer)
+            : unregisteredDepth_(unregisteredDepth), rays_(rays), rayDx_(rayDx), rayDy_(rayDy),
+              translation_(translation), registeredCameraMatrix_(registeredCameraMatrix), distCoeffs_(distCoeffs),
+              hasDistortion_(hasDistortion), inputDepthToMetersScale_(inputDepthToMetersScale),
+              depthToRegistered_(depthToRegistered), zBuffer_(zBuffer)
+        {
+        }
+
+        virtual void
+        operator()(const Range &range) const
+        {
+            const float infinity = std::numeric_limits<float>::infinity();
+            const int cols = unregisteredDepth_.cols;
+            static const float corners[4][2] = { { -0.5f, -0.5f }, { 0.5f, -0.5f }, { -0.5f, 0.5f }, { 0.5f, 0.5f } };
+
+            for (int j = range.start; j < range.end; ++j)
+            {
+                Vec2f *mapped = depthToRegistered_.ptr<Vec2f>(j);
+                for (int i = 0; i < cols; ++i)
+                {
+                    mapped[i] = Vec2f(infinity, infinity);
+                    const float z = depthInMeters<DepthDepth>(unregisteredDepth_(j, i), inputDepthToMetersScale_);
+                    float u, v, w;
+                    if (!project(rays_(j, i), z, u, v, w))
+                        continue;
+                    const int x = cvRound(u), y = cvRound(v);
+                    if (x < 0 || y < 0 || x >= zBuffer_.cols || y >= zBuffer_.rows)
+                        continue;
+                    mapped[i] = Vec2f(u, v);
+
+                    // The external pixels whose center is covered by the projected corners of this pixel
+                    float uMin = u, uMax = u, vMin = v, vMax = v;
+                    bool isCovered = true;
+                    for (int c = 0; c < 4 && isCovered; ++c)
+                    {
+                        float cornerU, cornerV, cornerW;
+                        isCovered = project(rays_(j, i) + rayDx_ * corners[c][0] + rayDy_ * corners[c][1], z,
+                                            cornerU, cornerV, cornerW);
+                        uMin = std::min(uMin, cornerU);
+                        uMax = std::max(uMax, cornerU);
+                        vMin = std::min(vMin, cornerV);
+                        vMax = std::max(vMax, cornerV);
+                    }
+                    int x0 = x, x1 = x, y0 = y, y1 = y;
+                    if (isCovered)
+                    {
+                        x0 = std::max(std::min(x0, cvCeil(uMin)), 0);
+                        x1 = std::min(std::max(x1, cvFloor(uMax)), zBuffer_.cols - 1);
+                        y0 = std::max(std::min(y0, cvCeil(vMin)), 0);
+                        y1 = std::min(std::max(y1, cvFloor(vMax)), zBuffer_.rows - 1);
+                    }
+
+                    const uint64 key = ((uint64)floatBits(w) << 32) | (uint64)(j * cols + i);
+                    for (int yy = y0; yy <= y1; ++yy)
+                    {
+                        uint64 *zBufferRow = zBuffer_.ptr<uint64>(yy);
+                        for (int xx = x0; xx <= x1; ++xx)
+                            atomicMin(zBufferRow + xx, key);
+                    }
+                }
+            }
+        }
+
+    private:
+        // Pixel location of z * ray + translation in the external image and its depth, false if behind the camera
+        bool
+        project(const Vec3f &ray, float z, float &u, float &v, float &w) const
+        {
+            w = z * ray[2] + translation_[2];
+            if (!(w > 0))
+                return false;
+            u = (z * ray[0] + translation_[0]) / w;
+            v = (z * ray[1] + translation_[1]) / w;
+            if (hasDistortion_)
+                distortPoint(distCoeffs_, registeredCameraMatrix_, u, v);
+            return true;
+        }
+
+        const Mat_<DepthDepth> &unregisteredDepth_;
+        const Mat_<Vec3f> &rays_;
+        Vec3f rayDx_, rayDy_;
+        Vec3f translation_;
+        Matx33f registeredCameraMatrix_;
+        const float *distCoeffs_;
+        bool hasDistortion_;
+        float inputDepthToMetersScale_;
+        Mat &depthToRegistered_;
+        Mat &zBuffer_;
+    };
+
+    template<typename DepthDepth>
+    static void
+    zBufferToDepth(const Mat &zBuffer, Mat &registeredDepth)
+    {
+        for (int y = 0; y < zBuffer.rows; ++y)
+        {
+            const unsigned int *bits = zBuffer.ptr<unsigned int>(y);
+            DepthDepth *depth = registeredDepth.ptr<DepthDepth>(y);
+            for (int x = 0; x < zBuffer.cols; ++x)
+                depth[x] = (bits[x] == 0xffffffffu) ? noDepthSentinelValue<DepthDepth>()
+                                                    : floatToInputDepth<DepthDepth>(bitsToFloat(bits[x]));
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////////
+
+    DepthRegistration::DepthRegistration(InputArray unregisteredCameraMatrix, InputArray registeredCameraMatrix,
+                                         InputArray registeredDistCoeffs, InputArray Rt,
+                                         const Size& outputImagePlaneSize)
+        : outputImagePlaneSize_(outputImagePlaneSize)
+    {
+        CV_Assert(unregisteredCameraMatrix.depth() == CV_64F || unregisteredCameraMatrix.depth() == CV_32F);
+
+        CV_Assert(registeredCameraMatrix.depth() == CV_64F || registeredCameraMatrix.depth() == CV_32F);
+
+        CV_Assert(registeredDistCoeffs.empty() || registeredDistCoeffs.depth() == CV_64F || registeredDistCoeffs.depth() == CV_32F);
+
+        CV_Assert(registeredDistCoeffs.total() <= 8);
+
+        CV_Assert(Rt.depth() == CV_64F || Rt.depth() == CV_32F);
+
+        CV_Assert(outputImagePlaneSize.height > 0 && outputImagePlaneSize.width > 0);
+
+        unregisteredCameraMatrix_ = unregisteredCameraMatrix.getMat();
+        registeredCameraMatrix_ = registeredCameraMatrix.getMat();
+        rbtRgb2Depth_ = Rt.getMat();
+
+        Mat_<float> distCoeffs = registeredDistCoeffs.getMat();
+        for (int i = 0; i < 8; ++i)
+            distCoeffs_[i] = (i < (int)distCoeffs.total()) ? distCoeffs(i) : 0.f;
+        hasDistortion_ = !distCoeffs.empty() && (countNonZero(distCoeffs) > 0);
+    }
+
+    /** Splits the projection of every pixel (i,j) of depth z in an affine function of z: z * ray(i,j) + translation.
+     * Without distortion, the external camera matrix is folded in as well.
+     */
+    void
+    DepthRegistration::initialize(const Size& unregisteredDepthSize) const
+    {
+        if (unregisteredDepthSize == unregisteredDepthSize_)
+            return;
+
+        Matx44f K = Matx44f::zeros();
+        for(unsigned char j = 0; j < 3; ++j)
+            for(unsigned char i = 0; i < 3; ++i)
+                K(j, i) = unregisteredCameraMatrix_(j, i);
+        K(3, 3) = 1;
+
+        Matx44f projection = rbtRgb2Depth_ * K.inv();
+        if (!hasDistortion_)
+        {
+            Matx44f registeredK = Matx44f::zeros();
+            for(unsigned char j = 0; j < 3; ++j)
+                for(unsigned char i = 0; i < 3; ++i)
+                    registeredK(j, i) = registeredCameraMatrix_(j, i);
+            registeredK(3, 3) = 1;
+            projection = registeredK * projection;
+        }
+
+        rayDx_ = Vec3f(projection(0, 0), projection(1, 0), projection(2, 0));
+        rayDy_ = Vec3f(projection(0, 1), projection(1, 1), projection(2, 1));
+        rays_.create(unregisteredDepthSize);
+        for (int j = 0; j < rays_.rows; ++j)
+        {
+            Vec3f *ray = rays_[j];
+            for (int i = 0; i < rays_.cols; ++i)
+                for (int k = 0; k < 3; ++k)
+                    ray[i][k] = projection(k, 0) * i + projection(k, 1) * j + projection(k, 2);
+        }
+        translation_ = Vec3f(projection(0, 3), projection(1, 3), projection(2, 3));
+        unregisteredDepthSize_ = unregisteredDepthSize;
+    }
+
+    void
+    DepthRegistration::operator()(InputArray unregisteredDepth, OutputArray registeredDepth, bool depthDilation) const
+    {
+        // A default constructed object has no external camera to register to
+        CV_Assert(outputImagePlaneSize_.height > 0 && outputImagePlaneSize_.width > 0);
+
+        CV_Assert(unregisteredDepth.cols() > 0 && unregisteredDepth.rows() > 0 &&
+                  (unregisteredDepth.depth() == CV_32F || unregisteredDepth.depth() == CV_64F || unregisteredDepth.depth() == CV_16U));
+
+        Mat depth = unregisteredDepth.getMat();
+        initialize(depth.size());
+
+        // 0xffffffff is larger than the bits of any depth
+        zBuffer_.create(outputImagePlaneSize_, CV_32S);
+        zBuffer_.setTo(Scalar::all(-1));
+
+        registeredDepth.create(outputImagePlaneSize_, depth.type());
+        Mat registeredDepthMat = registeredDepth.getMat();
+        switch (depth.depth())
+        {
+            case CV_16U:
+            {
+                const Mat_<unsigned short> typedDepth(depth);
+                parallel_for_(Range(0, depth.rows),
+                              RegistrationBody<unsigned short>(typedDepth, rays_, translation_, registeredCameraMatrix_,
+                                                               distCoeffs_, hasDistortion_, depthDilation, .001f,
+                                                               zBuffer_));
+                zBufferToDepth<unsigned short>(zBuffer_, registeredDepthMat);
+                break;
+            }
+            case CV_32F:
+            {
+                const Mat_<float> typedDepth(depth);
+                parallel_for_(Range(0, depth.rows),
+                              RegistrationBody<float>(typedDepth, rays_, translation_, registeredCameraMatrix_,
+                                                      distCoeffs_, hasDistortion_, depthDilation, 1.0f, zBuffer_));
+                zBufferToDepth<float>(zBuffer_, registeredDepthMat);
+                break;
+            }
+            case CV_64F:
+            {
+                const Mat_<double> typedDepth(depth);
+                parallel_for_(Range(0, depth.rows),
+                              RegistrationBody<double>(typedDepth, rays_, translation_, registeredCameraMatrix_,
+                                                       distCoeffs_, hasDistortion_, depthDilation, 1.0f, zBuffer_));
+                zBufferToDepth<double>(zBuffer_, registeredDepthMat);
+                break;
+            }
+        }
+    }
+
+
 
 
     void
@@ -340,6 +744,40 @@ namespace rgbd
         Matx44f _rbtRgb2Depth = Rt.getMat();
 
 
+        // Distortion models up to 8 coefficients go through the precomputed and parallel registration. The
+        // DepthRegistration of the last calibration is kept, so a stream only computes its rays and z-buffer once.
+        // It holds per call buffers, so callers take turns on it
+        if (registeredDistCoeffs.total() <= 8)
+        {
+            static Mutex mutex;
+            static Ptr<DepthRegistration> cachedRegistration;
+            static Matx33f cachedUnregisteredCameraMatrix, cachedRegisteredCameraMatrix;
+            static Matx<float, 8, 1> cachedDistCoeffs;
+            static Matx44f cachedRt;
+            static Size cachedOutputImagePlaneSize;
+
+            Matx<float, 8, 1> distCoeffs = Matx<float, 8, 1>::zeros();
+            for (int i = 0; i < (int)_registeredDistCoeffs.total(); ++i)
+                distCoeffs(i) = _registeredDistCoeffs(i);
+
+            AutoLock lock(mutex);
+            if (cachedRegistration.empty() || _unregisteredCameraMatrix != cachedUnregisteredCameraMatrix ||
+                _registeredCameraMatrix != cachedRegisteredCameraMatrix || distCoeffs != cachedDistCoeffs ||
+                _rbtRgb2Depth != cachedRt || outputImagePlaneSize != cachedOutputImagePlaneSize)
+            {
+                cachedRegistration = Ptr<DepthRegistration>(
+                    new DepthRegistration(unregisteredCameraMatrix, registeredCameraMatrix, registeredDistCoeffs, Rt,
+                                          outputImagePlaneSize));
+                cachedUnregisteredCameraMatrix = _unregisteredCameraMatrix;
+                cachedRegisteredCameraMatrix = _registeredCameraMatrix;
+                cachedDistCoeffs = distCoeffs;
+                cachedRt = _rbtRgb2Depth;
+                cachedOutputImagePlaneSize = outputImagePlaneSize;
+            }
+            (*cachedRegistration)(unregisteredDepth, registeredDepth, depthDilation);
+            return;
+        }
+
         Mat &registeredDepthMat = registeredDepth.getMatRef();
 
         switch (unregisteredDepth.depth())
@@ -377,5 +815,69 @@ namespace rgbd
 
     }
 
+    void
+    DepthRegistration::computeLookupTables(InputArray unregisteredDepth)
+    {
+        CV_Assert(outputImagePlaneSize_.height > 0 && outputImagePlaneSize_.width > 0);
+
+        CV_Assert(unregisteredDepth.cols() > 0 && unregisteredDepth.rows() > 0 &&
+                  (unregisteredDepth.depth() == CV_32F || unregisteredDepth.depth() == CV_64F || unregisteredDepth.depth() == CV_16U));
+
+        Mat depth = unregisteredDepth.getMat();
+        initialize(depth.size());
+
+        depthToRegistered_.create(depth.size(), CV_32FC2);
+        Mat zBuffer(outputImagePlaneSize_, CV_32SC2, Scalar::all(-1));
+        switch (depth.depth())
+        {
+            case CV_16U:
+            {
+                const Mat_<unsigned short> typedDepth(depth);
+                parallel_for_(Range(0, depth.rows),
+                              LookupTablesBody<unsigned short>(typedDepth, rays_, rayDx_, rayDy_, translation_,
+                                                               registeredCameraMatrix_, distCoeffs_, hasDistortion_,
+                                                               .001f, depthToRegistered_, zBuffer));
+                break;
+            }
+            case CV_32F:
+            {
+                const Mat_<float> typedDepth(depth);
+                parallel_for_(Range(0, depth.rows),
+                              LookupTablesBody<float>(typedDepth, rays_, rayDx_, rayDy_, translation_,
+                                                      registeredCameraMatrix_, distCoeffs_, hasDistortion_, 1.0f,
+                                                      depthToRegistered_, zBuffer));
+                break;
+            }
+            case CV_64F:
+            {
+                const Mat_<double> typedDepth(depth);
+                parallel_for_(Range(0, depth.rows),
+                              LookupTablesBody<double>(typedDepth, rays_, rayDx_, rayDy_, translation_,
+                                                       registeredCameraMatrix_, distCoeffs_, hasDistortion_, 1.0f,
+                                                       depthToRegistered_, zBuffer));
+                break;
+            }
+        }
+
+        // Keep the index of the winning depth pixel of every external pixel
+        const float infinity = std::numeric_limits<float>::infinity();
+        registeredToDepth_.create(outputImagePlaneSize_, CV_32FC2);
+        for (int y = 0; y < zBuffer.rows; ++y)
+        {
+            const uint64 *keys = zBuffer.ptr<uint64>(y);
+            Vec2f *mapped = registeredToDepth_.ptr<Vec2f>(y);
+            for (int x = 0; x < zBuffer.cols; ++x)
+            {
+                if (keys[x] == ~(uint64)0)
+                {
+                    mapped[x] = Vec2f(infinity, infinity);
+                    continue;
+                }
+                const int index = (int)(keys[x] & 0xffffffffu);
+                mapped[x] = Vec2f(float(index % depth.cols), float(index / depth.cols));
+            }
+        }
+    }
+
 } /* namespace rgbd */
 } /* namespace cv */
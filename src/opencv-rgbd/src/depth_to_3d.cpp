@@ -42,6 +42,95 @@ namespace cv
 {
 namespace rgbd
 {
+  /** Depth in meters: CV_16U is in millimeters with 0 meaning no depth, like in rescaleDepth
+   */
+  static inline float
+  depthInMeters(ushort depth)
+  {
+    return depth ? depth * 0.001f : std::numeric_limits<float>::quiet_NaN();
+  }
+
+  static inline float
+  depthInMeters(float depth)
+  {
+    return depth;
+  }
+
+#if CV_SSE2
+  static inline __m128
+  depthInMeters_ps(const ushort* depth)
+  {
+    __m128 d = _mm_cvtepi32_ps(
+        _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(depth)), _mm_setzero_si128()));
+    __m128 is_zero = _mm_cmpeq_ps(d, _mm_setzero_ps());
+    return _mm_or_ps(_mm_andnot_ps(is_zero, _mm_mul_ps(d, _mm_set1_ps(0.001f))),
+                     _mm_and_ps(is_zero, _mm_set1_ps(std::numeric_limits<float>::quiet_NaN())));
+  }
+
+  static inline __m128
+  depthInMeters_ps(const float* depth)
+  {
+    return _mm_loadu_ps(depth);
+  }
+#endif
+
+  /** Converts a row of depth to 3d points, given the ray of every column and the ray of the row
+   * @param points the interleaved 3d points, or 0
+   * @param x_out the planes of coordinates, used if points is 0
+   */
+  template<typename DepthDepth>
+  static void
+  depthTo3dRow(const DepthDepth* depth, const float* x_rays, float y_ray, int cols, Vec3f* points, float* x_out,
+               float* y_out, float* z_out)
+  {
+    int x = 0;
+#if CV_SSE2
+    if (checkHardwareSupport(CPU_SSE2))
+    {
+      const __m128 y_ray4 = _mm_set1_ps(y_ray);
+      float* points_ptr = reinterpret_cast<float*>(points);
+      for (; x + 4 <= cols; x += 4)
+      {
+        __m128 z = depthInMeters_ps(depth + x);
+        __m128 px = _mm_mul_ps(_mm_loadu_ps(x_rays + x), z);
+        __m128 py = _mm_mul_ps(y_ray4, z);
+        if (points)
+        {
+          // Interleave to x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+          __m128 xy_lo = _mm_unpacklo_ps(px, py), xy_hi = _mm_unpackhi_ps(px, py);
+          __m128 zx_lo = _mm_unpacklo_ps(z, px), zx_hi = _mm_unpackhi_ps(z, px);
+          __m128 yz_lo = _mm_unpacklo_ps(py, z), yz_hi = _mm_unpackhi_ps(py, z);
+          _mm_storeu_ps(points_ptr + 3 * x, _mm_shuffle_ps(xy_lo, zx_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+          _mm_storeu_ps(points_ptr + 3 * x + 4, _mm_shuffle_ps(yz_lo, xy_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+          _mm_storeu_ps(points_ptr + 3 * x + 8, _mm_shuffle_ps(zx_hi, yz_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+        }
+        else
+        {
+          _mm_storeu_ps(x_out + x, px);
+          _mm_storeu_ps(y_out + x, py);
+          _mm_storeu_ps(z_out + x, z);
+        }
+      }
+    }
+#endif
+    for (; x < cols; ++x)
+    {
+      float z = depthInMeters(depth[x]);
+      if (points)
+      {
+        points[x][0] = x_rays[x] * z;
+        points[x][1] = y_ray * z;
+        points[x][2] = z;
+      }
+      else
+      {
+        x_out[x] = x_rays[x] * z;
+        y_out[x] = y_ray * z;
+        z_out[x] = z;
+      }
+    }
+  }
+
   /**
    * @param K
    * @param depth the depth image
@@ -172,45 +261,190 @@ namespace rgbd
 
 ///////////////////////////////////////////////////////////////////////////////
 
+  /** Projects a range of (u, v) pairs to 3d points, see depthTo3dSparse
+   */
+  template<typename DepthDepth, typename PointDepth>
+  class SparseTo3d: public ParallelLoopBody
+  {
+  public:
+    SparseTo3d(const cv::Mat& depth, const cv::Mat_<float>& K, float scale, const PointDepth* points, Vec3f* points3d)
+        :
+          depth_(depth),
+          scale_(scale),
+          points_(points),
+          points3d_(points3d)
+    {
+      inv_fx_ = 1.f / K(0, 0);
+      inv_fy_ = 1.f / K(1, 1);
+      skew_ = K(0, 1);
+      cx_ = K(0, 2);
+      cy_ = K(1, 2);
+    }
+
+    virtual void
+    operator()(const Range& range) const
+    {
+      for (int i = range.start; i < range.end; ++i)
+      {
+        float u = float(points_[2 * i]), v = float(points_[2 * i + 1]);
+        float z = std::numeric_limits<float>::quiet_NaN();
+        // Bounds are checked on the coordinates themselves: (-1, 0) is out of the image, and NaN or huge
+        // coordinates never reach the integer conversion
+        if (u >= 0 && v >= 0 && u < depth_.cols && v < depth_.rows)
+        {
+          int x = cvFloor(u), y = cvFloor(v);
+          DepthDepth depth = depth_.at<DepthDepth>(y, x);
+          if (isValidDepth(depth))
+            z = depth * scale_;
+        }
+
+        float y_ray = (v - cy_) * inv_fy_;
+        Vec3f& point = points3d_[i];
+        point[0] = (u - cx_ - skew_ * y_ray) * inv_fx_ * z;
+        point[1] = y_ray * z;
+        point[2] = z;
+      }
+    }
+
+  private:
+    const cv::Mat& depth_;
+    float scale_;
+    const PointDepth* points_;
+    Vec3f* points3d_;
+    float inv_fx_, inv_fy_, skew_, cx_, cy_;
+  };
+
+  template<typename DepthDepth, typename PointDepth>
+  static void
+  depthTo3dSparseImpl(const cv::Mat& depth, const cv::Mat_<float>& K, float scale, const cv::Mat& points,
+                      cv::Mat& points3d)
+  {
+    int n_points = (int) points.total();
+    SparseTo3d<DepthDepth, PointDepth> body(depth, K, scale, points.ptr<PointDepth>(), points3d.ptr<Vec3f>());
+    // Only split batches that are worth waking threads for
+    const int batch_size = 4096;
+    if (n_points <= batch_size)
+      body(Range(0, n_points));
+    else
+      parallel_for_(Range(0, n_points), body, double(n_points) / batch_size);
+  }
+
+  template<typename DepthDepth>
+  static void
+  depthTo3dSparseImpl(const cv::Mat& depth, const cv::Mat_<float>& K, float scale, const cv::Mat& points,
+                      cv::Mat& points3d)
+  {
+    switch (points.depth())
+    {
+      case CV_32S:
+        depthTo3dSparseImpl<DepthDepth, int>(depth, K, scale, points, points3d);
+        break;
+      case CV_64F:
+        depthTo3dSparseImpl<DepthDepth, double>(depth, K, scale, points, points3d);
+        break;
+      default:
+        depthTo3dSparseImpl<DepthDepth, float>(depth, K, scale, points, points3d);
+        break;
+    }
+  }
+
   /**
    * @param K
    * @param depth the depth image
-   * @param u_mat the list of x coordinates
-   * @param v_mat the list of matching y coordinates
+   * @param points_in the list of (u, v) coordinates, pixels out of the depth image give NaN points
    * @param points3d the resulting 3d points
    */
   void
   depthTo3dSparse(InputArray depth_in, InputArray K_in, InputArray points_in, OutputArray points3d_out)
   {
-    // Make sure we use foat types
     cv::Mat points = points_in.getMat();
     cv::Mat depth = depth_in.getMat();
+    CV_Assert(depth.type() == CV_16UC1 || depth.type() == CV_16SC1 || depth.type() == CV_32FC1);
+    CV_Assert(points.channels() == 2);
 
-    cv::Mat points_float;
-    if (points.depth() != CV_32F)
+    // The pairs are read in place, other types than int, float and double are converted first
+    if ((points.depth() != CV_32S && points.depth() != CV_32F && points.depth() != CV_64F) || !points.isContinuous())
+    {
+      cv::Mat points_float;
       points.convertTo(points_float, CV_32FC2);
-    else
-      points_float = points;
+      points = points_float;
+    }
 
-    // Fill the depth matrix
-    cv::Mat_<float> z_mat;
+    cv::Mat_<float> K;
+    K_in.getMat().convertTo(K, CV_32F);
+
+    points3d_out.create(points.rows, points.cols, CV_32FC3);
+    cv::Mat points3d = points3d_out.getMat();
+    if (points.total() == 0)
+      return;
 
     if (depth.depth() == CV_16U)
-      convertDepthToFloat<ushort>(depth, 1.0f / 1000.0f, points_float, z_mat);
-    else if (depth.depth() == CV_16U)
-      convertDepthToFloat<short>(depth, 1.0f / 1000.0f, points_float, z_mat);
+      depthTo3dSparseImpl<ushort>(depth, K, 1.0f / 1000.0f, points, points3d);
+    else if (depth.depth() == CV_16S)
+      depthTo3dSparseImpl<short>(depth, K, 1.0f / 1000.0f, points, points3d);
     else
+      depthTo3dSparseImpl<float>(depth, K, 1.0f, points, points3d);
+  }
+
+  /** Computes the rays of every column and row of a rows x cols image for the calibration matrix K
+   */
+  static void
+  computeRays(const cv::Mat& K_in, int rows, int cols, cv::Mat_<float>& x_rays, cv::Mat_<float>& y_rays)
+  {
+    cv::Mat_<float> K;
+    K_in.convertTo(K, CV_32F);
+    const float inv_fx = 1.f / K(0, 0);
+    const float inv_fy = 1.f / K(1, 1);
+    const float ox = K(0, 2);
+    const float oy = K(1, 2);
+
+    x_rays.create(1, cols);
+    y_rays.create(1, rows);
+    for (int x = 0; x < cols; ++x)
+      x_rays(0, x) = (x - ox) * inv_fx;
+    for (int y = 0; y < rows; ++y)
+      y_rays(0, y) = (y - oy) * inv_fy;
+  }
+
+  /** Gets the rays of depthTo3d from a cache shared by all its callers, keyed on K and the image size.
+   * New rays go in new matrices, so callers still converting with the previous ones are not affected
+   */
+  static void
+  getCachedRays(const cv::Mat& K, int rows, int cols, cv::Mat_<float>& x_rays, cv::Mat_<float>& y_rays)
+  {
+    static cv::Mutex mutex;
+    static Matx33f cached_K;
+    static int cached_rows = 0, cached_cols = 0;
+    static cv::Mat_<float> cached_x_rays, cached_y_rays;
+
+    Matx33f K_key = K;
+
+    cv::AutoLock lock(mutex);
+    if (rows != cached_rows || cols != cached_cols || K_key != cached_K)
     {
-      CV_Assert(depth.type() == CV_32F);
-      convertDepthToFloat<float>(depth, 1.0f, points_float, z_mat);
+      cached_x_rays = cv::Mat_<float>();
+      cached_y_rays = cv::Mat_<float>();
+      computeRays(K, rows, cols, cached_x_rays, cached_y_rays);
+      cached_K = K_key;
+      cached_rows = rows;
+      cached_cols = cols;
     }
+    x_rays = cached_x_rays;
+    y_rays = cached_y_rays;
+  }
 
-    std::vector<cv::Mat> channels(2);
-    cv::split(points_float, channels);
-
-    points3d_out.create(channels[0].rows, channels[0].cols, CV_32FC3);
-    cv::Mat points3d = points3d_out.getMat();
-    depthTo3d_from_uvz(K_in.getMat(), channels[0], channels[1], z_mat, points3d);
+  /** Converts a CV_16U or CV_32F depth image to CV_32FC3 points with the rays of its columns and rows
+   */
+  static void
+  depthTo3dRays(const cv::Mat& depth, const cv::Mat_<float>& x_rays, const cv::Mat_<float>& y_rays, cv::Mat& points3d)
+  {
+    for (int y = 0; y < depth.rows; ++y)
+    {
+      if (depth.depth() == CV_16U)
+        depthTo3dRow(depth.ptr<ushort>(y), x_rays[0], y_rays(0, y), depth.cols, points3d.ptr<Vec3f>(y), 0, 0, 0);
+      else
+        depthTo3dRow(depth.ptr<float>(y), x_rays[0], y_rays(0, y), depth.cols, points3d.ptr<Vec3f>(y), 0, 0, 0);
+    }
   }
 
   /**
@@ -253,11 +487,75 @@ namespace rgbd
     {
       points3d_out.create(depth.size(), CV_MAKETYPE(K_new.depth(), 3));
       cv::Mat points3d = points3d_out.getMat();
-      if (K_new.depth() == CV_64F)
+      if (K_new.depth() == CV_32F && (depth.depth() == CV_16U || depth.depth() == CV_32F))
+      {
+        cv::Mat_<float> x_rays, y_rays;
+        getCachedRays(K_new, depth.rows, depth.cols, x_rays, y_rays);
+        depthTo3dRays(depth, x_rays, y_rays, points3d);
+      }
+      else if (K_new.depth() == CV_64F)
         depthTo3dNoMask<double>(depth, K_new, points3d);
       else
         depthTo3dNoMask<float>(depth, K_new, points3d);
     }
   }
+
+///////////////////////////////////////////////////////////////////////////////
+
+  DepthTo3dTable::DepthTo3dTable(InputArray K)
+      :
+        K_(K.getMat()),
+        rows_(0),
+        cols_(0)
+  {
+    CV_Assert(K_.cols == 3 && K_.rows == 3 && (K_.depth() == CV_64F || K_.depth() == CV_32F));
+  }
+
+  /** Builds the rays of every column and row for the given image size, unless they are already there
+   */
+  void
+  DepthTo3dTable::initialize(int rows, int cols) const
+  {
+    if (rows == rows_ && cols == cols_)
+      return;
+
+    computeRays(K_, rows, cols, x_rays_, y_rays_);
+    rows_ = rows;
+    cols_ = cols;
+  }
+
+  void
+  DepthTo3dTable::operator()(InputArray depth_in, OutputArray points3d_out) const
+  {
+    cv::Mat depth = depth_in.getMat();
+    CV_Assert(depth.type() == CV_16UC1 || depth.type() == CV_32FC1);
+    initialize(depth.rows, depth.cols);
+
+    points3d_out.create(depth.size(), CV_32FC3);
+    cv::Mat points3d = points3d_out.getMat();
+    depthTo3dRays(depth, x_rays_, y_rays_, points3d);
+  }
+
+  void
+  DepthTo3dTable::operator()(InputArray depth_in, OutputArray x_out, OutputArray y_out, OutputArray z_out) const
+  {
+    cv::Mat depth = depth_in.getMat();
+    CV_Assert(depth.type() == CV_16UC1 || depth.type() == CV_32FC1);
+    initialize(depth.rows, depth.cols);
+
+    x_out.create(depth.size(), CV_32F);
+    y_out.create(depth.size(), CV_32F);
+    z_out.create(depth.size(), CV_32F);
+    cv::Mat x_mat = x_out.getMat(), y_mat = y_out.getMat(), z_mat = z_out.getMat();
+    for (int y = 0; y < depth.rows; ++y)
+    {
+      if (depth.depth() == CV_16U)
+        depthTo3dRow(depth.ptr<ushort>(y), x_rays_[0], y_rays_(0, y), depth.cols, (Vec3f*) 0, x_mat.ptr<float>(y),
+                     y_mat.ptr<float>(y), z_mat.ptr<float>(y));
+      else
+        depthTo3dRow(depth.ptr<float>(y), x_rays_[0], y_rays_(0, y), depth.cols, (Vec3f*) 0, x_mat.ptr<float>(y),
+                     y_mat.ptr<float>(y), z_mat.ptr<float>(y));
+    }
+  }
 }
 }
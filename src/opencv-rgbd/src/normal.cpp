@@ -161,6 +161,63 @@ namespace rgbd
     }
   }
 
+  /** Stores a normal in the output format, see RgbdNormals::RGBD_NORMALS_FORMAT
+   */
+  template<typename T>
+  inline
+  void
+  storeNormal(const Vec<T, 3> & normal, Vec<T, 3> & out)
+  {
+    out = normal;
+  }
+  template<typename T>
+  inline
+  void
+  storeNormal(const Vec<T, 3> & normal, Vec2s & out)
+  {
+    out = packNormal(float(normal[0]), float(normal[1]), float(normal[2]));
+  }
+
+  /** Sums count rows of n values into sum
+   */
+  template<typename T>
+  static inline void
+  sumRows(const T* const * rows, int count, T* sum, int n)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      T value = rows[0][i];
+      for (int k = 1; k < count; ++k)
+        value += rows[k][i];
+      sum[i] = value;
+    }
+  }
+
+  static inline void
+  sumRows(const float* const * rows, int count, float* sum, int n)
+  {
+    int i = 0;
+#if CV_SSE2
+    if (checkHardwareSupport(CPU_SSE2))
+    {
+      for (; i + 4 <= n; i += 4)
+      {
+        __m128 value = _mm_loadu_ps(rows[0] + i);
+        for (int k = 1; k < count; ++k)
+          value = _mm_add_ps(value, _mm_loadu_ps(rows[k] + i));
+        _mm_storeu_ps(sum + i, value);
+      }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+      float value = rows[0][i];
+      for (int k = 1; k < count; ++k)
+        value += rows[k][i];
+      sum[i] = value;
+    }
+  }
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
   class RgbdNormalsImpl
@@ -269,55 +326,143 @@ namespace rgbd
     }
 
     /** Compute the normals
-     * @param r
-     * @return
+     * @param points3d the 3d points, of type Vec3T
+     * @param mask if not empty, normals are only written where it is not 0
+     * @param roi the part of the image to compute normals on
+     * @param normals the output normals
      */
-    virtual void
-    compute(const Mat&, const Mat &r, Mat & normals) const
+    void
+    compute(const Mat& points3d, const Mat& mask, const Rect& roi, Mat & normals) const
     {
-      // Compute B
-      Mat_<Vec3T> B(rows_, cols_);
+      const int band_rows = 16;
+      // A ring of window_size_ rows of B and a row of their sums per band, padded for the horizontal box filter.
+      // Sized for the whole image so that it does not change with the roi
+      B_rings_.create(((rows_ + band_rows - 1) / band_rows) * (window_size_ + 1), cols_ + window_size_ - 1);
+      int bands = (roi.height + band_rows - 1) / band_rows;
+      if (normals.type() == CV_16SC2)
+        parallel_for_(Range(0, bands), Bands<Vec2s>(*this, points3d, mask, roi, normals, band_rows));
+      else
+        parallel_for_(Range(0, bands), Bands<Vec3T>(*this, points3d, mask, roi, normals, band_rows));
+    }
 
-      const T* row_r = r.ptr < T > (0), *row_r_end = row_r + rows_ * cols_;
-      const Vec3T *row_V = V_[0];
-      Vec3T *row_B = B[0];
-      for (; row_r != row_r_end; ++row_r, ++row_B, ++row_V)
+  private:
+    /** Computes bands of band_rows rows of normals of the roi in one pass: every row of B = V / r is computed once per
+     * band into a ring buffer, the rows of the ring are summed and the box filter is finished horizontally with a
+     * running sum right before the Minv*B product and the normalization. B is computed on the roi and a halo of
+     * half the window around it, borders of the image are reflected like the boxFilter of M.
+     * NormalT is the type of the output normals, see storeNormal
+     */
+    template<typename NormalT>
+    class Bands: public ParallelLoopBody
+    {
+    public:
+      Bands(const FALS& fals, const Mat& points3d, const Mat& mask, const Rect& roi, Mat& normals, int band_rows)
+          :
+            fals_(fals),
+            points3d_(points3d),
+            mask_(mask),
+            roi_(roi),
+            normals_(normals),
+            band_rows_(band_rows)
       {
-        if (cvIsNaN(*row_r))
-          *row_B = Vec3T();
-        else
-          *row_B = (*row_V) / (*row_r);
       }
 
-      // Apply a box filter to B
-      boxFilter(B, B, B.depth(), Size(window_size_, window_size_), Point(-1, -1), false);
-
-      // compute the Minv*B products
-      row_r = r.ptr < T > (0);
-      const Vec3T * B_vec = B[0];
-      const Mat33T * M_inv = reinterpret_cast<const Mat33T *>(M_inv_.ptr(0));
-      Vec3T *normal = normals.ptr<Vec3T>(0);
-      for (; row_r != row_r_end; ++row_r, ++B_vec, ++normal, ++M_inv)
-        if (cvIsNaN(*row_r))
+      virtual void
+      operator()(const Range& range) const
+      {
+        const int cols = fals_.cols_;
+        const int window_size = fals_.window_size_, half = window_size / 2;
+        // Index 0 of the rows of the ring is the column x_pad, the columns [x_begin, x_end) are in the image
+        const int x_pad = roi_.x - half;
+        const int x_begin = std::max(x_pad, 0), x_end = std::min(roi_.x + roi_.width + half, cols);
+        for (int band = range.start; band < range.end; ++band)
         {
-          (*normal)[0] = *row_r;
-          (*normal)[1] = *row_r;
-          (*normal)[2] = *row_r;
+          Vec3T* ring[7];
+          for (int k = 0; k < window_size; ++k)
+            ring[k] = fals_.B_rings_[band * (window_size + 1) + k];
+          Vec3T* B_sum = fals_.B_rings_[band * (window_size + 1) + window_size];
+
+          int y_begin = roi_.y + band * band_rows_;
+          int y_end = std::min(y_begin + band_rows_, roi_.y + roi_.height);
+          for (int p = y_begin - half; p < y_begin + half; ++p)
+            computeB(p, x_pad, x_begin, x_end, ring);
+          for (int y = y_begin; y < y_end; ++y)
+          {
+            computeB(y + half, x_pad, x_begin, x_end, ring);
+
+            // Vertical then horizontal sums, with the borders of the image reflected. Only the columns
+            // [x_begin, x_end) of the ring are computed, they start at x_begin - x_pad in every row
+            const T* rows[7];
+            for (int k = 0; k < window_size; ++k)
+              rows[k] = reinterpret_cast<const T*>(ring[k] + x_begin - x_pad);
+            sumRows(rows, window_size, reinterpret_cast<T*>(B_sum + x_begin - x_pad), 3 * (x_end - x_begin));
+            for (int x = x_pad; x < x_begin; ++x)
+              B_sum[x - x_pad] = B_sum[borderInterpolate(x, cols, BORDER_REFLECT_101) - x_pad];
+            for (int x = x_end; x < roi_.x + roi_.width + half; ++x)
+              B_sum[x - x_pad] = B_sum[borderInterpolate(x, cols, BORDER_REFLECT_101) - x_pad];
+            Vec3T B;
+            for (int i = 0; i < window_size - 1; ++i)
+              B += B_sum[i];
+
+            const Vec3T* point = points3d_.ptr<Vec3T>(y) + roi_.x;
+            const Mat33T* M_inv = reinterpret_cast<const Mat33T*>(fals_.M_inv_[y] + roi_.x);
+            const uchar* mask = mask_.empty() ? 0 : mask_.ptr<uchar>(y) + roi_.x;
+            NormalT* normal = normals_.ptr<NormalT>(y) + roi_.x;
+            for (int x = 0; x < roi_.width; ++x)
+            {
+              B += B_sum[x + window_size - 1];
+              if (!mask || mask[x])
+              {
+                T r2 = point[x].dot(point[x]);
+                Vec3T n(r2, r2, r2);
+                if (!cvIsNaN(r2))
+                {
+                  const Mat33T& Mr = M_inv[x];
+                  signNormal(Mr(0, 0) * B[0] + Mr(0, 1) * B[1] + Mr(0, 2) * B[2],
+                             Mr(1, 0) * B[0] + Mr(1, 1) * B[1] + Mr(1, 2) * B[2],
+                             Mr(2, 0) * B[0] + Mr(2, 1) * B[1] + Mr(2, 2) * B[2], n);
+                }
+                storeNormal(n, normal[x]);
+              }
+              B -= B_sum[x];
+            }
+          }
         }
-        else
+      }
+
+    private:
+      /** Computes the columns [x_begin, x_end) of the row of B of the padded row index p into its slot of the ring
+       */
+      void
+      computeB(int p, int x_pad, int x_begin, int x_end, Vec3T* const * ring) const
+      {
+        const int window_size = fals_.window_size_;
+        int y = borderInterpolate(p, fals_.rows_, BORDER_REFLECT_101);
+        Vec3T* B = ring[(p + window_size) % window_size] - x_pad;
+        const Vec3T* point = points3d_.ptr<Vec3T>(y);
+        const Vec3T* V = fals_.V_[y];
+        for (int x = x_begin; x < x_end; ++x)
         {
-            Mat33T Mr = *M_inv;
-            Vec3T Br = *B_vec;
-            Vec3T MBr(Mr(0, 0) * Br[0] + Mr(0, 1)*Br[1] + Mr(0, 2)*Br[2],
-                      Mr(1, 0) * Br[0] + Mr(1, 1)*Br[1] + Mr(1, 2)*Br[2],
-                      Mr(2, 0) * Br[0] + Mr(2, 1)*Br[1] + Mr(2, 2)*Br[2]);
-           signNormal(MBr, *normal);
+          T r = norm_vec(point[x]);
+          if (cvIsNaN(r))
+            B[x] = Vec3T();
+          else
+            B[x] = V[x] / r;
         }
-    }
+      }
+
+      const FALS& fals_;
+      const Mat& points3d_;
+      const Mat& mask_;
+      Rect roi_;
+      Mat& normals_;
+      int band_rows_;
+    };
 
-  private:
     Mat_<Vec3T> V_;
     Mat_<Vec9T> M_inv_;
+
+    mutable Mat_<Vec3T> B_rings_;
   };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -339,6 +484,112 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
   res[2] = (T)c;
 }
 
+  /** Fits the depth gradient D of equation (8) of the LINEMOD paper at the pixels [x_begin, x_end) of a row, from
+   * the samples at -r, 0 and r pixels that are within difference_threshold of the pixel depth. As in the paper,
+   * dx and dy are not divided by det.
+   * @param row the row of the depth, the rows r above and below are step elements away
+   * @param mask if not null, pixels where it is 0 are skipped
+   */
+  template<typename DepthDepth, typename ContainerDepth>
+  static void
+  fitLinemodGradients(const DepthDepth* row, size_t step, int r, int x_begin, int x_end, const uchar* mask,
+                      ContainerDepth difference_threshold, ContainerDepth* dx, ContainerDepth* dy, ContainerDepth* det)
+  {
+    for (int x = x_begin; x < x_end; ++x)
+    {
+      if (mask && !mask[x])
+        continue;
+      DepthDepth d = row[x];
+
+      ContainerDepth A[3] = { 0, 0, 0 }, b[2] = { 0, 0 };
+      for (int j = -r; j <= r; j += r)
+        for (int i = -r; i <= r; i += r)
+        {
+          // We need to cast to ContainerDepth in case we have unsigned DepthDepth
+          ContainerDepth delta = ContainerDepth(row[x + j * (ptrdiff_t)step + i]) - ContainerDepth(d);
+          if (std::abs(delta) > difference_threshold)
+            continue;
+          A[0] += ContainerDepth(i * i);
+          A[1] += ContainerDepth(i * j);
+          A[2] += ContainerDepth(j * j);
+          b[0] += i * delta;
+          b[1] += j * delta;
+        }
+
+      det[x] = A[0] * A[2] - A[1] * A[1];
+      dx[x] = A[2] * b[0] - A[1] * b[1];
+      dy[x] = -A[1] * b[0] + A[0] * b[1];
+    }
+  }
+
+  /** Same as above on CV_16U depth in integers, which are exact: with a threshold of 50 all the terms fit in 32 bits.
+   * The 8 neighbours of 4 pixels are compared at once and only the counts and the sums of the accepted differences
+   * on each side are kept, as the sample offsets are all -r, 0 or r.
+   */
+  static void
+  fitLinemodGradients(const unsigned short* row, size_t step, int r, int x_begin, int x_end, const uchar* mask,
+                      int difference_threshold, int* dx, int* dy, int* det)
+  {
+    int x = x_begin;
+#if CV_SSE2
+    if (checkHardwareSupport(CPU_SSE2))
+    {
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i threshold = _mm_set1_epi32(difference_threshold + 1);
+      int CV_DECL_ALIGNED(16) counts[3][4], sums[2][4];
+      for (; x + 4 <= x_end; x += 4)
+      {
+        if (mask && !(mask[x] | mask[x + 1] | mask[x + 2] | mask[x + 3]))
+          continue;
+        __m128i d = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + x)), zero);
+
+        // count_x and count_y count the accepted samples off each axis, count_xy the sign of i * j over them
+        __m128i count_x = zero, count_y = zero, count_xy = zero, sum_x = zero, sum_y = zero;
+        for (int j = -1; j <= 1; ++j)
+          for (int i = -1; i <= 1; ++i)
+          {
+            if ((i == 0) && (j == 0))
+              continue;
+            const unsigned short* sample = row + x + j * r * (ptrdiff_t)step + i * r;
+            __m128i delta = _mm_sub_epi32(
+                _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(sample)), zero), d);
+            __m128i sign = _mm_srai_epi32(delta, 31);
+            __m128i accepted = _mm_cmplt_epi32(_mm_sub_epi32(_mm_xor_si128(delta, sign), sign), threshold);
+            __m128i accepted_delta = _mm_and_si128(accepted, delta);
+            // accepted is -1 for the accepted samples
+            if (i != 0)
+            {
+              count_x = _mm_sub_epi32(count_x, accepted);
+              sum_x = (i > 0) ? _mm_add_epi32(sum_x, accepted_delta) : _mm_sub_epi32(sum_x, accepted_delta);
+            }
+            if (j != 0)
+            {
+              count_y = _mm_sub_epi32(count_y, accepted);
+              sum_y = (j > 0) ? _mm_add_epi32(sum_y, accepted_delta) : _mm_sub_epi32(sum_y, accepted_delta);
+            }
+            if ((i != 0) && (j != 0))
+              count_xy = (i * j > 0) ? _mm_sub_epi32(count_xy, accepted) : _mm_add_epi32(count_xy, accepted);
+          }
+        _mm_store_si128(reinterpret_cast<__m128i*>(counts[0]), count_x);
+        _mm_store_si128(reinterpret_cast<__m128i*>(counts[1]), count_xy);
+        _mm_store_si128(reinterpret_cast<__m128i*>(counts[2]), count_y);
+        _mm_store_si128(reinterpret_cast<__m128i*>(sums[0]), sum_x);
+        _mm_store_si128(reinterpret_cast<__m128i*>(sums[1]), sum_y);
+
+        for (int n = 0; n < 4; ++n)
+        {
+          int A0 = r * r * counts[0][n], A1 = r * r * counts[1][n], A2 = r * r * counts[2][n];
+          int b0 = r * sums[0][n], b1 = r * sums[1][n];
+          det[x + n] = A0 * A2 - A1 * A1;
+          dx[x + n] = A2 * b0 - A1 * b1;
+          dy[x + n] = -A1 * b0 + A0 * b1;
+        }
+      }
+    }
+#endif
+    fitLinemodGradients<unsigned short, int>(row, step, r, x, x_end, mask, difference_threshold, dx, dy, det);
+  }
+
   /** Given a depth image, compute the normals as detailed in the LINEMOD paper
    * ``Gradient Response Maps for Real-Time Detection of Texture-Less Objects``
    * by S. Hinterstoisser, C. Cagniart, S. Ilic, P. Sturm, N. Navab, P. Fua, and V. Lepetit
@@ -364,64 +615,113 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
     {
     }
 
-    /** Compute the normals
-     * @param r
+    /** Compute the normals, the pixels of the roi closer than r to the border are left as they are
+     * @param depth_in the depth image
+     * @param mask if not empty, normals are only written where it is not 0
+     * @param roi the part of the image to compute normals on
      * @param normals the output normals
      */
     void
-    compute(const Mat& depth_in, Mat & normals) const
+    compute(const Mat& depth_in, const Mat& mask, const Rect& roi, Mat & normals) const
     {
       switch (depth_in.depth())
       {
         case CV_16U:
         {
           const Mat_<unsigned short> &depth(depth_in);
-          computeImpl<unsigned short, long>(depth, normals);
+          computeImpl<unsigned short, int>(depth, mask, roi, normals);
           break;
         }
         case CV_32F:
         {
           const Mat_<float> &depth(depth_in);
-          computeImpl<float, float>(depth, normals);
+          computeImpl<float, float>(depth, mask, roi, normals);
           break;
         }
         case CV_64F:
         {
           const Mat_<double> &depth(depth_in);
-          computeImpl<double, double>(depth, normals);
+          computeImpl<double, double>(depth, mask, roi, normals);
           break;
         }
       }
     }
 
   private:
+    /** Computes rows of normals from the gradients given by fitLinemodGradients, as NormalT, see storeNormal
+     */
+    template<typename DepthDepth, typename ContainerDepth, typename NormalT>
+    class Rows: public ParallelLoopBody
+    {
+    public:
+      Rows(const Mat_<DepthDepth>& depth, const Mat& mask, const Mat33T& K_inv, int r, int x_begin, int x_end,
+           Mat& normals)
+          :
+            depth_(depth),
+            mask_(mask),
+            K_inv_(K_inv),
+            r_(r),
+            x_begin_(x_begin),
+            x_end_(x_end),
+            normals_(normals)
+      {
+      }
+
+      virtual void
+      operator()(const Range& range) const
+      {
+        const int cols = depth_.cols;
+        AutoBuffer<ContainerDepth> buffer(3 * cols);
+        ContainerDepth *dx = buffer, *dy = dx + cols, *det = dy + cols;
+        Vec3T X1_minus_X, X2_minus_X;
+        for (int y = range.start; y < range.end; ++y)
+        {
+          const DepthDepth* depth = depth_[y];
+          const uchar* mask = mask_.empty() ? 0 : mask_.ptr<uchar>(y);
+          fitLinemodGradients(depth, depth_.step1(), r_, x_begin_, x_end_, mask, ContainerDepth(50), dx, dy, det);
+
+          NormalT* normal = normals_.ptr<NormalT>(y);
+          for (int x = x_begin_; x < x_end_; ++x)
+          {
+            if (mask && !mask[x])
+              continue;
+            // Compute the dot product
+            //Vec3T X = K_inv * Vec3T(x, y, 1) * depth(y, x);
+            //Vec3T X1 = K_inv * Vec3T(x + 1, y, 1) * (depth(y, x) + dx);
+            //Vec3T X2 = K_inv * Vec3T(x, y + 1, 1) * (depth(y, x) + dy);
+            //Vec3T nor = (X1 - X).cross(X2 - X);
+            // As dx and dy are not divided by det, X1_minus_X and X2_minus_X are multiplied by det instead
+            // (which does not matter as we normalize the normals)
+            T d_det = T(depth[x]) * T(det[x]);
+            multiply_by_K_inv(K_inv_, d_det + T(x + 1) * T(dx[x]), T(y) * T(dx[x]), T(dx[x]), X1_minus_X);
+            multiply_by_K_inv(K_inv_, T(x) * T(dy[x]), d_det + T(y + 1) * T(dy[x]), T(dy[x]), X2_minus_X);
+            Vec3T nor = X1_minus_X.cross(X2_minus_X);
+            signNormal(nor, nor);
+            storeNormal(nor, normal[x]);
+          }
+        }
+      }
+
+    private:
+      const Mat_<DepthDepth>& depth_;
+      const Mat& mask_;
+      Mat33T K_inv_;
+      int r_;
+      int x_begin_, x_end_;
+      Mat& normals_;
+    };
+
     /** Compute the normals
-     * @param r
-     * @return
+     * @param depth the depth image
+     * @param mask if not empty, the pixels to compute normals at
+     * @param roi the part of the image to compute normals on
+     * @param normals the output normals
      */
     template<typename DepthDepth, typename ContainerDepth>
-    Mat
-    computeImpl(const Mat_<DepthDepth> &depth, Mat & normals) const
+    void
+    computeImpl(const Mat_<DepthDepth> &depth, const Mat& mask, const Rect& roi, Mat & normals) const
     {
       const int r = 5; // used to be 7
-      const int sample_step = r;
-      const int square_size = ((2 * r / sample_step) + 1);
-      long offsets[square_size * square_size];
-      long offsets_x[square_size * square_size];
-      long offsets_y[square_size * square_size];
-      long offsets_x_x[square_size * square_size];
-      long offsets_x_y[square_size * square_size];
-      long offsets_y_y[square_size * square_size];
-      for (int j = -r, index = 0; j <= r; j += sample_step)
-        for (int i = -r; i <= r; i += sample_step, ++index)
-        {
-          offsets_x[index] = i;
-          offsets_y[index] = j;
-          offsets_x_x[index] = i*i;
-          offsets_x_y[index] = i*j;
-          offsets_y_y[index] = j*j;
-          offsets[index] = j * cols_ + i;
-        }
 
       // Define K_inv by hand, just for higher accuracy
       Mat33T K_inv = Matx<T, 3, 3>::eye(), K;
@@ -432,61 +732,17 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
       K_inv(1, 1) = 1 / K(1, 1);
       K_inv(1, 2) = -K(1, 2) / K(1, 1);
 
-      Vec3T X1_minus_X, X2_minus_X;
-
-      ContainerDepth difference_threshold = 50;
-      normals.setTo(std::numeric_limits<DepthDepth>::quiet_NaN());
-      for (int y = r; y < rows_ - r - 1; ++y)
-      {
-        const DepthDepth * p_line = reinterpret_cast<const DepthDepth*>(depth.ptr(y, r));
-        Vec3T *normal = normals.ptr<Vec3T>(y, r);
-
-        for (int x = r; x < cols_ - r - 1; ++x)
-        {
-          DepthDepth d = p_line[0];
-
-          // accum
-          long A[4];
-          A[0] = A[1] = A[2] = A[3] = 0;
-          ContainerDepth b[2];
-          b[0] = b[1] = 0;
-          for (unsigned int i = 0; i < square_size * square_size; ++i) {
-            // We need to cast to ContainerDepth in case we have unsigned DepthDepth
-            ContainerDepth delta = ContainerDepth(p_line[offsets[i]]) - ContainerDepth(d);
-            if (std::abs(delta) > difference_threshold)
-               continue;
-
-             A[0] += offsets_x_x[i];
-             A[1] += offsets_x_y[i];
-             A[3] += offsets_y_y[i];
-             b[0] += offsets_x[i] * delta;
-             b[1] += offsets_y[i] * delta;
-          }
-
-          // solve for the optimal gradient D of equation (8)
-          long det = A[0] * A[3] - A[1] * A[1];
-          // We should divide the following two by det, but instead, we multiply
-          // X1_minus_X and X2_minus_X by det (which does not matter as we normalize the normals)
-          // Therefore, no division is done: this is only for speedup
-          ContainerDepth dx = (A[3] * b[0] - A[1] * b[1]);
-          ContainerDepth dy = (-A[1] * b[0] + A[0] * b[1]);
-
-          // Compute the dot product
-          //Vec3T X = K_inv * Vec3T(x, y, 1) * depth(y, x);
-          //Vec3T X1 = K_inv * Vec3T(x + 1, y, 1) * (depth(y, x) + dx);
-          //Vec3T X2 = K_inv * Vec3T(x, y + 1, 1) * (depth(y, x) + dy);
-          //Vec3T nor = (X1 - X).cross(X2 - X);
-          multiply_by_K_inv(K_inv, d * det + (x + 1) * dx, y * dx, dx, X1_minus_X);
-          multiply_by_K_inv(K_inv, x * dy, d * det + (y + 1) * dy, dy, X2_minus_X);
-          Vec3T nor = X1_minus_X.cross(X2_minus_X);
-          signNormal(nor, *normal);
-
-          ++p_line;
-          ++normal;
-        }
-      }
-
-      return normals;
+      // The window reads r pixels around every pixel
+      int y_begin = std::max(roi.y, r), y_end = std::min(roi.y + roi.height, rows_ - r - 1);
+      int x_begin = std::max(roi.x, r), x_end = std::min(roi.x + roi.width, cols_ - r - 1);
+      if ((y_begin >= y_end) || (x_begin >= x_end))
+        return;
+      if (normals.type() == CV_16SC2)
+        parallel_for_(Range(y_begin, y_end),
+                      Rows<DepthDepth, ContainerDepth, Vec2s>(depth, mask, K_inv, r, x_begin, x_end, normals));
+      else
+        parallel_for_(Range(y_begin, y_end),
+                      Rows<DepthDepth, ContainerDepth, Vec3T>(depth, mask, K_inv, r, x_begin, x_end, normals));
     }
   };
 
@@ -592,25 +848,50 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
      * @param r
      * @return
      */
-    virtual void
-    compute(const Mat& points3d, const Mat &r, Mat & normals) const
+    void
+    compute(const Mat& points3d, const Mat &r, const Mat& mask, const Rect& roi, Mat & normals) const
     {
       const Mat_<T>& r_T(r);
       const Mat_<Vec3T> &points3d_T(points3d);
-      compute(points3d_T, r_T, normals);
+      compute(points3d_T, r_T, mask, roi, normals);
     }
 
     /** Compute the normals
-     * @param r
-     * @return
+     * @param r the distance of the points to the camera
+     * @param mask if not empty, normals are only written where it is not 0
+     * @param roi the part of the image to compute normals on: only the part of the SRI it is interpolated from,
+     *        plus the margin of the derivative kernels, is computed
+     * @param normals_out the output normals
      */
     void
-    compute(const Mat_<Vec3T> &, const Mat_<T> &r_non_interp, Mat & normals_out) const
+    compute(const Mat_<Vec3T> &, const Mat_<T> &r_non_interp, const Mat& mask, const Rect& roi,
+            Mat & normals_out) const
     {
+      Rect sri_roi(0, 0, cols_, rows_);
+      if (roi != sri_roi)
+      {
+        float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+        for (int y = roi.y; y < roi.y + roi.height; ++y)
+        {
+          const Vec2f* location = euclideanMap_[y];
+          for (int x = roi.x; x < roi.x + roi.width; ++x)
+          {
+            min_x = std::min(min_x, location[x][0]);
+            max_x = std::max(max_x, location[x][0]);
+            min_y = std::min(min_y, location[x][1]);
+            max_y = std::max(max_y, location[x][1]);
+          }
+        }
+        // Linear interpolation reads up to floor + 1, the kernels half the window further
+        int margin = window_size_ / 2;
+        sri_roi &= Rect(Point(cvFloor(min_x) - margin, cvFloor(min_y) - margin),
+                        Point(cvFloor(max_x) + margin + 2, cvFloor(max_y) + margin + 2));
+      }
+
       // Interpolate the radial image to make derivatives meaningful
       Mat_<T> r;
       // higher quality remapping does not help here
-      remap(r_non_interp, r, xy_, fxy_, INTER_LINEAR);
+      remap(r_non_interp, r, xy_(sri_roi), fxy_(sri_roi), INTER_LINEAR);
 
       // Compute the derivatives with respect to theta and phi
       // TODO add bilateral filtering (as done in kinfu)
@@ -620,40 +901,73 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
       //it depends on resolution, be careful
       sepFilter2D(r, r_phi, r.depth(), kx_dy_, ky_dy_);
 
-      // Fill the result matrix
-      Mat_<Vec3T> normals(rows_, cols_);
-
-      const T* r_theta_ptr = r_theta[0], *r_theta_ptr_end = r_theta_ptr + rows_ * cols_;
-      const T* r_phi_ptr = r_phi[0];
-      const Mat33T * R = reinterpret_cast<const Mat33T *>(R_hat_[0]);
-      const T* r_ptr = r[0];
-      Vec3T * normal = normals[0];
-      for (; r_theta_ptr != r_theta_ptr_end; ++r_theta_ptr, ++r_phi_ptr, ++R, ++r_ptr, ++normal)
+      // Fill the result matrix, only sri_roi is ever read back
+      normals_sri_.create(rows_, cols_);
+      for (int y = 0; y < sri_roi.height; ++y)
       {
-        if (cvIsNaN(*r_ptr))
+        const T* r_theta_ptr = r_theta[y], *r_theta_ptr_end = r_theta_ptr + sri_roi.width;
+        const T* r_phi_ptr = r_phi[y];
+        const Mat33T * R = reinterpret_cast<const Mat33T *>(R_hat_[sri_roi.y + y] + sri_roi.x);
+        const T* r_ptr = r[y];
+        Vec3T * normal = normals_sri_[sri_roi.y + y] + sri_roi.x;
+        for (; r_theta_ptr != r_theta_ptr_end; ++r_theta_ptr, ++r_phi_ptr, ++R, ++r_ptr, ++normal)
         {
-          (*normal)[0] = *r_ptr;
-          (*normal)[1] = *r_ptr;
-          (*normal)[2] = *r_ptr;
-        }
-        else
-        {
-          T r_theta_over_r = (*r_theta_ptr) / (*r_ptr);
-          T r_phi_over_r = (*r_phi_ptr) / (*r_ptr);
-          // R(1,1) is 0
-          signNormal((*R)(0, 0) + (*R)(0, 1) * r_theta_over_r + (*R)(0, 2) * r_phi_over_r,
-                     (*R)(1, 0) + (*R)(1, 2) * r_phi_over_r,
-                     (*R)(2, 0) + (*R)(2, 1) * r_theta_over_r + (*R)(2, 2) * r_phi_over_r, *normal);
+          if (cvIsNaN(*r_ptr))
+          {
+            (*normal)[0] = *r_ptr;
+            (*normal)[1] = *r_ptr;
+            (*normal)[2] = *r_ptr;
+          }
+          else
+          {
+            T r_theta_over_r = (*r_theta_ptr) / (*r_ptr);
+            T r_phi_over_r = (*r_phi_ptr) / (*r_ptr);
+            // R(1,1) is 0
+            signNormal((*R)(0, 0) + (*R)(0, 1) * r_theta_over_r + (*R)(0, 2) * r_phi_over_r,
+                       (*R)(1, 0) + (*R)(1, 2) * r_phi_over_r,
+                       (*R)(2, 0) + (*R)(2, 1) * r_theta_over_r + (*R)(2, 2) * r_phi_over_r, *normal);
+          }
         }
       }
 
-      remap(normals, normals_out, invxy_, invfxy_, INTER_LINEAR);
-      normal = normals_out.ptr<Vec3T>(0);
-      Vec3T * normal_end = normal + rows_ * cols_;
-      for (; normal != normal_end; ++normal)
-        signNormal((*normal)[0], (*normal)[1], (*normal)[2], *normal);
+      // Map back to the roi of the output, which is already allocated so remap writes in place, unless the output is
+      // packed
+      Mat normals_roi = normals_out(roi);
+      if (normals_out.type() == CV_16SC2)
+      {
+        remap(normals_sri_, normals_remapped_, invxy_(roi), invfxy_(roi), INTER_LINEAR);
+        normalize<Vec2s>(normals_remapped_, mask, roi, normals_roi);
+      }
+      else
+      {
+        remap(normals_sri_, normals_roi, invxy_(roi), invfxy_(roi), INTER_LINEAR);
+        normalize<Vec3T>(normals_roi, mask, roi, normals_roi);
+      }
     }
   private:
+    /** Normalizes the remapped normals of the roi into NormalT, see storeNormal. Both can be the same matrix
+     */
+    template<typename NormalT>
+    static void
+    normalize(const Mat& normals_remapped, const Mat& mask, const Rect& roi, Mat& normals_roi)
+    {
+      const T nan = std::numeric_limits<T>::quiet_NaN();
+      for (int y = 0; y < roi.height; ++y)
+      {
+        const uchar* mask_row = mask.empty() ? 0 : mask.ptr<uchar>(roi.y + y) + roi.x;
+        const Vec3T * normal_remapped = normals_remapped.ptr<Vec3T>(y);
+        NormalT * normal = normals_roi.ptr<NormalT>(y);
+        for (int x = 0; x < roi.width; ++x)
+        {
+          Vec3T n(nan, nan, nan);
+          if (!mask_row || mask_row[x])
+            signNormal(normal_remapped[x][0], normal_remapped[x][1], normal_remapped[x][2], n);
+          storeNormal(n, normal[x]);
+        }
+      }
+    }
+
+
     /** Stores R */
     Mat_<Vec9T> R_hat_;
     float phi_step_, theta_step_;
@@ -666,6 +980,9 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
 
     Mat_<Vec2f> euclideanMap_;
     Mat invxy_, invfxy_;
+
+    /** The normals in the SRI and remapped to the image for packed outputs, kept between calls */
+    mutable Mat_<Vec3T> normals_sri_, normals_remapped_;
   };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -680,6 +997,7 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
         K_(K_in.getMat()),
         window_size_(window_size),
         method_(method_in),
+        format_(RGBD_NORMALS_FORMAT_VEC3),
         rgbd_normals_impl_(0)
   {
     CV_Assert(depth == CV_32F || depth == CV_64F);
@@ -784,12 +1102,67 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
     }
   }
 
+  /** Bounding box of the non zero pixels of a CV_8UC1 mask
+   */
+  static Rect
+  maskBoundingRect(const Mat& mask)
+  {
+    int x_min = mask.cols, x_max = -1, y_min = mask.rows, y_max = -1;
+    for (int y = 0; y < mask.rows; ++y)
+    {
+      const uchar* row = mask.ptr<uchar>(y);
+      int x_first = 0, x_last = mask.cols - 1;
+      while (x_first < mask.cols && !row[x_first])
+        ++x_first;
+      if (x_first == mask.cols)
+        continue;
+      while (!row[x_last])
+        --x_last;
+      x_min = std::min(x_min, x_first);
+      x_max = std::max(x_max, x_last);
+      y_min = std::min(y_min, y);
+      y_max = y;
+    }
+    if (y_max < 0)
+      return Rect();
+    return Rect(x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
+  }
+
   /** Given a set of 3d points in a depth image, compute the normals at each point
    * @param points3d_in depth a float depth image. Or it can be rows x cols x 3 is they are 3d points
    * @param normals a rows x cols x 3 matrix
+   * @param mask_in the pixels to compute normals at, all of them if empty
+   */
+  void
+  RgbdNormals::operator()(InputArray points3d_in, OutputArray normals_out, InputArray mask_in) const
+  {
+    Mat mask = mask_in.getMat();
+    std::vector<Rect> rois;
+    if (mask.empty())
+      rois.push_back(Rect(0, 0, points3d_in.cols(), points3d_in.rows()));
+    else
+    {
+      CV_Assert(mask.type() == CV_8UC1 && mask.size() == points3d_in.size());
+      // Only the bounding box of the mask is processed
+      rois.push_back(maskBoundingRect(mask));
+    }
+    compute_normals_impl(points3d_in, normals_out, mask, rois);
+  }
+
+  /** Same as above, but only computing normals in some rectangles of the image
    */
   void
-  RgbdNormals::operator()(InputArray points3d_in, OutputArray normals_out) const
+  RgbdNormals::operator()(InputArray points3d_in, OutputArray normals_out, const std::vector<Rect>& rois) const
+  {
+    compute_normals_impl(points3d_in, normals_out, Mat(), rois);
+  }
+
+  /** Computes the normals in rectangles of the image, the other normals are NaN unless the rectangles cover the
+   * whole image
+   */
+  void
+  RgbdNormals::compute_normals_impl(InputArray points3d_in, OutputArray normals_out, const Mat& mask,
+                                    const std::vector<Rect>& rois_in) const
   {
     Mat points3d_ori = points3d_in.getMat();
 
@@ -829,58 +1202,94 @@ multiply_by_K_inv(const Matx<T, 3, 3> & K_inv, U a, U b, U c, Vec<T, 3> &res)
       else
         points3d_ori.convertTo(points3d, depth_);
 
-      // Compute the distance to the points
-      if (depth_ == CV_32F)
-        radius = computeRadius<float>(points3d);
-      else
-        radius = computeRadius<double>(points3d);
+      // Compute the distance to the points, FALS does it on the fly
+      if (method_ == RGBD_NORMALS_METHOD_SRI)
+      {
+        if (depth_ == CV_32F)
+          radius = computeRadius<float>(points3d);
+        else
+          radius = computeRadius<double>(points3d);
+      }
     }
 
     // Get the normals
-    normals_out.create(points3d_ori.size(), CV_MAKETYPE(depth_, 3));
+    CV_Assert(format_ == RGBD_NORMALS_FORMAT_VEC3 || format_ == RGBD_NORMALS_FORMAT_OCTAHEDRAL);
+    bool is_packed = (format_ == RGBD_NORMALS_FORMAT_OCTAHEDRAL);
+    normals_out.create(points3d_ori.size(), is_packed ? CV_16SC2 : CV_MAKETYPE(depth_, 3));
     if (points3d_in.empty())
       return;
 
     Mat normals = normals_out.getMat();
-    switch (method_)
+    const Rect image(0, 0, points3d_ori.cols, points3d_ori.rows);
+    std::vector<Rect> rois;
+    for (size_t i = 0; i < rois_in.size(); ++i)
     {
-      case (RGBD_NORMALS_METHOD_FALS):
-      {
-        if (depth_ == CV_32F)
-          reinterpret_cast<const FALS<float> *>(rgbd_normals_impl_)->compute(points3d, radius, normals);
-        else
-          reinterpret_cast<const FALS<double> *>(rgbd_normals_impl_)->compute(points3d, radius, normals);
-        break;
-      }
-      case RGBD_NORMALS_METHOD_LINEMOD:
+      Rect roi = rois_in[i] & image;
+      if (roi.area() > 0)
+        rois.push_back(roi);
+    }
+    // LINEMOD never writes the border of the image
+    bool is_whole_image = (rois.size() == 1) && (rois[0] == image) && mask.empty();
+    if (!is_whole_image || method_ == RGBD_NORMALS_METHOD_LINEMOD)
+      normals.setTo(is_packed ? Scalar::all(SHRT_MIN) : Scalar::all(std::numeric_limits<double>::quiet_NaN()));
+
+    // Only focus on the depth image for LINEMOD
+    Mat depth;
+    if (method_ == RGBD_NORMALS_METHOD_LINEMOD)
+    {
+      if (points3d_ori.channels() == 3)
+        extractChannel(points3d_ori, depth, 2);
+      else
+        depth = points3d_ori;
+    }
+
+    for (size_t i = 0; i < rois.size(); ++i)
+    {
+      const Rect& roi = rois[i];
+      switch (method_)
       {
-        // Only focus on the depth image for LINEMOD
-        Mat depth;
-        if (points3d_ori.channels() == 3)
+        case (RGBD_NORMALS_METHOD_FALS):
         {
-          std::vector<Mat> channels;
-          split(points3d, channels);
-          depth = channels[2];
+          if (depth_ == CV_32F)
+            reinterpret_cast<const FALS<float> *>(rgbd_normals_impl_)->compute(points3d, mask, roi, normals);
+          else
+            reinterpret_cast<const FALS<double> *>(rgbd_normals_impl_)->compute(points3d, mask, roi, normals);
+          break;
+        }
+        case RGBD_NORMALS_METHOD_LINEMOD:
+        {
+          if (depth_ == CV_32F)
+            reinterpret_cast<const LINEMOD<float> *>(rgbd_normals_impl_)->compute(depth, mask, roi, normals);
+          else
+            reinterpret_cast<const LINEMOD<double> *>(rgbd_normals_impl_)->compute(depth, mask, roi, normals);
+          break;
+        }
+        case RGBD_NORMALS_METHOD_SRI:
+        {
+          if (depth_ == CV_32F)
+            reinterpret_cast<const SRI<float> *>(rgbd_normals_impl_)->compute(points3d, radius, mask, roi, normals);
+          else
+            reinterpret_cast<const SRI<double> *>(rgbd_normals_impl_)->compute(points3d, radius, mask, roi, normals);
+          break;
         }
-        else
-          depth = points3d_ori;
-
-        if (depth_ == CV_32F)
-          reinterpret_cast<const LINEMOD<float> *>(rgbd_normals_impl_)->compute(depth, normals);
-        else
-          reinterpret_cast<const LINEMOD<double> *>(rgbd_normals_impl_)->compute(depth, normals);
-        break;
-      }
-      case RGBD_NORMALS_METHOD_SRI:
-      {
-        if (depth_ == CV_32F)
-          reinterpret_cast<const SRI<float> *>(rgbd_normals_impl_)->compute(points3d, radius, normals);
-        else
-          reinterpret_cast<const SRI<double> *>(rgbd_normals_impl_)->compute(points3d, radius, normals);
-        break;
       }
     }
   }
+
+  void
+  unpackNormals(InputArray packed_in, OutputArray normals_out)
+  {
+    CV_Assert(packed_in.type() == CV_16SC2);
+    Mat packed = packed_in.getMat();
+    normals_out.create(packed.size(), CV_32FC3);
+    Mat normals = normals_out.getMat();
+    for (int y = 0; y < packed.rows; ++y)
+    {
+      const Vec2s* packed_row = packed.ptr<Vec2s>(y);
+      Vec3f* normal = normals.ptr<Vec3f>(y);
+      for (int x = 0; x < packed.cols; ++x)
+        normal[x] = unpackNormal(packed_row[x]);
+    }
+  }
 }
 }
-
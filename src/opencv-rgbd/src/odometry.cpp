@@ -124,8 +124,8 @@ void checkNormals(const Mat& normals, const Size& depthSize)
 {
     if(normals.size() != depthSize)
         CV_Error(Error::StsBadSize, "Normals has to have the size equal to the depth size.");
-    if(normals.type() != CV_32FC3)
-        CV_Error(Error::StsBadSize, "Normals type has to be CV_32FC3.");
+    if(normals.type() != CV_32FC3 && normals.type() != CV_16SC2)
+        CV_Error(Error::StsBadSize, "Normals type has to be CV_32FC3 or CV_16SC2.");
 }
 
 static
@@ -358,7 +358,13 @@ void preparePyramidNormals(const Mat& normals, const std::vector<Mat>& pyramidDe
     }
     else
     {
-        buildPyramid(normals, pyramidNormals, (int)pyramidDepth.size() - 1);
+        // Packed normals are decoded once, the pyramid is always CV_32FC3
+        Mat normals32f;
+        if(normals.type() == CV_16SC2)
+            unpackNormals(normals, normals32f);
+        else
+            normals32f = normals;
+        buildPyramid(normals32f, pyramidNormals, (int)pyramidDepth.size() - 1);
         // renormalize normals
         for(size_t i = 1; i < pyramidNormals.size(); i++)
         {
@@ -383,7 +383,7 @@ private:
 class InlierFinder
 {
 public:
-  InlierFinder(float err, const Mat_<Vec3f> & points3d, const Mat_<Vec3f> & normals,
+  InlierFinder(float err, const Mat_<Vec3f> & points3d, const Mat & normals,
                unsigned char plane_index, int block_size)
       :
         err_(err),
@@ -427,8 +427,11 @@ public:
       // Depending on whether you have a normal, check it
       if (!normals_.empty())
       {
-        const Vec3f* normal = normals_.ptr < Vec3f > (yy, range_x.start);
-        for (; data != data_end; ++data, ++point, ++normal, ++Q_local)
+        // The normals are either CV_32FC3 or packed, see RgbdNormals::RGBD_NORMALS_FORMAT
+        const bool is_packed = (normals_.type() == CV_16SC2);
+        const Vec3f* normal = is_packed ? 0 : normals_.ptr < Vec3f > (yy, range_x.start);
+        const Vec2s* packed_normal = is_packed ? normals_.ptr < Vec2s > (yy, range_x.start) : 0;
+        for (int i = 0; data != data_end; ++data, ++point, ++i, ++Q_local)
         {
           // Don't do anything if the point already belongs to another plane
           if (cvIsNaN(point->val[0]) || ((*data) != 255))
@@ -438,7 +441,7 @@ public:
           if (plane->distance(*point) < err_)
           {
             // make sure the normals are similar to the plane
-            if (std::abs(plane->n().dot(*normal)) > 0.3)
+            if (std::abs(plane->n().dot(is_packed ? unpackNormal(packed_normal[i]) : normal[i])) > 0.3)
             {
               // The point now belongs to the plane
               plane->UpdateStatistics(*point, *Q_local);
@@ -520,7 +523,7 @@ public:
 private:
   float err_;
   const Mat_<Vec3f> & points3d_;
-  const Mat_<Vec3f> & normals_;
+  const Mat & normals_;
   unsigned char plane_index_;
   /** THe block size as defined in the main algorithm */
   int block_size_;
@@ -540,14 +543,16 @@ private:
   RgbdPlane::operator()(InputArray points3d_in, InputArray normals_in, OutputArray mask_out,
                         OutputArray plane_coefficients_out)
   {
-    Mat_<Vec3f> points3d, normals;
+    Mat_<Vec3f> points3d;
+    Mat normals;
     if (points3d_in.depth() == CV_32F)
       points3d = points3d_in.getMat();
     else
       points3d_in.getMat().convertTo(points3d, CV_32F);
     if (!normals_in.empty())
     {
-      if (normals_in.depth() == CV_32F)
+      // Packed normals are decoded on the fly
+      if (normals_in.depth() == CV_32F || normals_in.type() == CV_16SC2)
         normals = normals_in.getMat();
       else
         normals_in.getMat().convertTo(normals, CV_32F);
@@ -0,0 +1,165 @@
+/*
+* StatusLoadTest.cpp
+*
+* Load test for the embedded status server (src/StatusServer.h). Opens
+* several keep-alive connections to a running SmartMonitor, alternates
+* GET /api/items and GET /api/status on each, and reports throughput and
+* latency percentiles. Finishes with an oversized request, which the
+* server has to answer with 431 and close.
+*
+*   StatusLoadTest [host] [port] [connections] [requests per connection]
+*
+* Header only standalone asio, e.g. the copy under Cinder/include:
+*   g++ -std=c++11 -O2 -DASIO_STANDALONE -I../../Cinder/include StatusLoadTest.cpp -pthread
+*
+*/
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include "asio/asio.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+// Reads one response off a keep-alive connection, returns the status code or -1.
+static int readResponse(tcp::socket& socket, asio::streambuf& buffer, string* body)
+{
+    asio::error_code ec;
+    size_t headerBytes = asio::read_until(socket, buffer, "\r\n\r\n", ec);
+    if (ec) return -1;
+
+    string header(asio::buffers_begin(buffer.data()), asio::buffers_begin(buffer.data()) + headerBytes);
+    buffer.consume(headerBytes);
+
+    int status = -1;
+    sscanf(header.c_str(), "HTTP/1.%*d %d", &status);
+    size_t lengthPos = header.find("Content-Length: ");
+    size_t length = lengthPos == string::npos ? 0 : strtoul(header.c_str() + lengthPos + 16, nullptr, 10);
+    if (buffer.size() < length)
+    {
+        asio::read(socket, buffer, asio::transfer_exactly(length - buffer.size()), ec);
+        if (ec) return -1;
+    }
+
+    body->assign(asio::buffers_begin(buffer.data()), asio::buffers_begin(buffer.data()) + length);
+    buffer.consume(length);
+    return status;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    const char* port = argc > 2 ? argv[2] : "8012"; // STATUS_SERVER_PORT in item.def
+    int connections = argc > 3 ? atoi(argv[3]) : 8;
+    int requests = argc > 4 ? atoi(argv[4]) : 2000;
+
+    asio::io_service io;
+    tcp::resolver resolver(io);
+    asio::error_code ec;
+    auto endpoints = resolver.resolve(tcp::resolver::query(host, port), ec);
+    if (ec)
+    {
+        fprintf(stderr, "can't resolve %s:%s: %s\n", host, port, ec.message().c_str());
+        return 1;
+    }
+    tcp::endpoint endpoint = *endpoints;
+
+    std::atomic<int> failures(0);
+    std::vector<std::vector<float>> latencies(connections);
+    std::vector<std::thread> clients;
+    auto start = Clock::now();
+    for (int c = 0; c < connections; c++)
+    {
+        clients.emplace_back([&, c]
+        {
+            asio::io_service clientIo;
+            tcp::socket socket(clientIo);
+            asio::error_code ec;
+            socket.connect(endpoint, ec);
+            if (ec)
+            {
+                failures += requests;
+                return;
+            }
+
+            asio::streambuf buffer;
+            string body;
+            latencies[c].reserve(requests);
+            for (int i = 0; i < requests; i++)
+            {
+                const char* request = (i & 1) ?
+                    "GET /api/items HTTP/1.1\r\nHost: smartmonitor\r\n\r\n" :
+                    "GET /api/status HTTP/1.1\r\nHost: smartmonitor\r\n\r\n";
+                auto sent = Clock::now();
+                asio::write(socket, asio::buffer(request, strlen(request)), ec);
+                int status = ec ? -1 : readResponse(socket, buffer, &body);
+                latencies[c].push_back(std::chrono::duration<float, std::micro>(Clock::now() - sent).count());
+                if (status != 200 || body.empty() || body.back() != '}')
+                {
+                    failures += requests - i;
+                    return;
+                }
+            }
+        });
+    }
+    for (auto& client : clients) client.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<float> all;
+    for (const auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    int total = connections * requests;
+    printf("%d/%d requests ok in %.2f s, %.0f req/s\n", total - failures.load(), total, seconds, all.size() / seconds);
+    if (!all.empty())
+    {
+        printf("latency us: p50 %.0f  p99 %.0f  max %.0f\n",
+            all[all.size() / 2], all[all.size() * 99 / 100], all.back());
+    }
+
+    // Headers that never end must be cut off at the server's limit, not buffered. The server answers 431 and
+    // closes with the rest of the request unread, so the close may arrive as a reset before the answer can be
+    // read. That counts too, as long as it comes well before the 30 s idle deadline would close the connection.
+    const char* verdict = "NOT rejected";
+    bool rejected = false;
+    {
+        tcp::socket socket(io);
+        socket.connect(endpoint, ec);
+        if (ec)
+        {
+            verdict = "can't connect";
+        }
+        else
+        {
+            string request = "GET /api/items HTTP/1.1\r\nX-Padding: " + string(16 * 1024, 'x');
+            auto sent = Clock::now();
+            asio::write(socket, asio::buffer(request), ec);
+            asio::streambuf buffer;
+            string body;
+            int status = ec ? -1 : readResponse(socket, buffer, &body);
+            if (status == 431)
+            {
+                verdict = "431";
+                rejected = true;
+            }
+            else if (status == -1 && Clock::now() - sent < std::chrono::seconds(5))
+            {
+                verdict = "closed by the server";
+                rejected = true;
+            }
+        }
+    }
+    printf("oversized request: %s\n", verdict);
+
+    return failures == 0 && rejected ? 0 : 1;
+}